@@ -1,6 +1,11 @@
 #include "Fl_Scroll_Tabs.H"
+#include "Fl_Scroll_Tabs_Format.H"
 #include <FL/fl_draw.H>
 #include <FL/Fl.H>
+#include <FL/x.H>
+#include <FL/Fl_Bitmap.H>
+#include <math.h>
+#include <stdio.h>
 
 #define TAB_SCROLL 8
 #define MINIMUM_TAB_HEIGHT 16
@@ -12,123 +17,995 @@
 #define INITIALREPEAT .5
 #define REPEAT .01
 
+// Scrolling is animated one frame at a time, moving by velocity times the time since the last frame.
+#define SCROLL_FRAME (1.0/60.0)
+#define MAXIMUM_FRAME_TIME .1  // longer gaps, like a stalled event loop, don't make the tabs jump
+#define BUTTON_SCROLL_SPEED (TAB_SCROLL/REPEAT)  // pixels per second while a scroll button is held
+#define WHEEL_STEP 48  // pixels per wheel notch without smooth scrolling
+#define WHEEL_IMPULSE 900.0  // pixels per second added per wheel notch
+#define MAXIMUM_WHEEL_SPEED 6000.0
+#define WHEEL_FRICTION 4.0  // wheel speed falls by e every 1/WHEEL_FRICTION seconds
+#define MINIMUM_SCROLL_SPEED 20.0
+#define SLIDE_RATE 12.0  // make_tab_visible() closes the distance by e every 1/SLIDE_RATE seconds
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+static double scroll_clock() {
+  LARGE_INTEGER frequency, count;
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&count);
+  return (double)count.QuadPart/(double)frequency.QuadPart;
+}
+#else
+#include <sys/time.h>
+#include <unistd.h>
+#include <pthread.h>
+static double scroll_clock() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec+tv.tv_usec*1e-6;
+}
+#endif
+
+#ifdef FL_SCROLL_TABS_STATS
+#define STAT(counter) (stats_.counter++)
+
+// Times a draw() or layout, until it goes out of scope
+struct Fl_Scroll_Tabs_Timer {
+  Fl_Scroll_Tabs *tabs;
+  int draw;
+  double start;
+  Fl_Scroll_Tabs_Timer(Fl_Scroll_Tabs *t, int d) : tabs(t), draw(d), start(scroll_clock()) {}
+  ~Fl_Scroll_Tabs_Timer() {tabs->timed(draw, scroll_clock()-start);}
+};
+#else
+#define STAT(counter)
+#endif
+
+// Damage bits for the parts of the widget that can be redrawn without the selected tab's group.
+#define DAMAGE_TABS FL_DAMAGE_SCROLL  // the tab strip, or just the tab rectangles passed with the damage
+#define DAMAGE_BUTTONS FL_DAMAGE_USER1  // the scroll buttons
+#define DAMAGE_HOVER FL_DAMAGE_USER2  // the tabs the mouse entered or left
+
+/*
+  The offscreen copy of the tab strip used by buffer_tabs(). It covers a few
+  widths of the tab bar around offset, and remembers everything it was drawn
+  with so that it is only drawn again when one of those changes.
+*/
+#define BUFFERED_VIEWS 3
+
+struct Fl_Scroll_Tabs_Strip {
+  Fl_Offscreen offscreen;
+  int w, h;
+  long from;  // the offset in the laid out strip that the buffer starts at
+  unsigned long layout_serial;
+  Fl_Color color, selection_color, labelcolor;
+  Fl_Font labelfont;
+  Fl_Fontsize labelsize;
+  const Fl_Widget *value;
+  int closebutton, tabs_on_bottom;
+  int hover_tab, hover_close;
+};
+
+/*
+  The close button's cross and the scroll arrows, drawn once into bitmaps.
+  A bitmap is drawn in the current color and leaves the pixels around its
+  shape alone, so one sprite serves every color, state and background, and
+  the X server keeps a copy once it is first drawn.
+*/
+#define SPRITE_CROSS 0
+#define SPRITE_LEFT 1
+#define SPRITE_RIGHT 2
+#define SPRITE_COUNT 3
+
+struct Fl_Scroll_Tabs_Sprite {
+  Fl_Bitmap *bitmap;
+  uchar *bits;
+  int w, h;  // the size it was drawn at
+};
+
+/*
+  The labels of the tabs, folded to lower case, and the tabs sorted by them
+  so that the tabs starting with some text are next to each other. Once made,
+  it is kept up to date by tab_positions() as tabs change, unless so many change
+  at once that making it again is quicker.
+*/
+#define FIND_TEXT_SIZE 64
+#define FIND_TIMEOUT 1.0  // seconds after a key press that the next one still adds to the text to find
+#define FIND_MAXIMUM_CHANGES 64  // tabs that can change in one layout before the index is made again
+#define FIND_BLOCK 256  // entries of the order in each block sorted by tab, see find_in_range()
+
+// Measuring labels in the background, see async_layout()
+#define ASYNC_MINIMUM_TABS 512  // fewer new tabs than this are measured right away
+#define ASYNC_CHUNK 1024  // tabs measured between handing measurements back
+#define ASYNC_FONTS 8  // label fonts and sizes the default metrics know
+
+struct Fl_Scroll_Tabs_Find {
+  int valid;  // zero when it must be made again from every tab
+  int changes;  // tabs changed in the current layout
+  int *order;  // tabs in the order of their keys
+  int *keys;  // where each tab's key is in pool, or -1 if it is not in order
+  int *blocks;  // order, with each FIND_BLOCK entries sorted by tab
+  int blocks_valid;  // zero when blocks must be sorted again from order
+  int count, capacity;  // tabs in order, and the size of order and keys
+  char *pool;
+  int pool_used, pool_size, pool_garbage;
+  char text[FIND_TEXT_SIZE];  // typed so far
+  int text_len;
+  double text_time;  // when it was last typed into
+};
+
 Fl_Scroll_Tabs::Fl_Scroll_Tabs(int ax, int ay, int aw, int ah, const char *l)
   : Fl_Tabs(ax, ay, aw, ah, l)
   , offset(0)
   , value_(NULL)
   , closebutton_(0)
   , close_callback_(NULL)
+  , close_batch_callback_(NULL)
+  , close_batch_callback_arg_(NULL)
   , tab_height_(MINIMUM_TAB_HEIGHT)
   , button_width_(MAXIMUM_BUTTON_WIDTH)
+  , tab_height_h_(-1)
+  , tab_height_children_(0)
   , minimum_tab_width_(8) 
   , maximum_tab_width_(128)
   , pressed_(-1) 
-  , tab_pos(NULL)
+  , value_index_(-1)
+  , value_children_(0)
+  , value_materialized_(0)
+  , lazy_first_(NULL)
+  , lazy_last_(NULL)
+  , lazy_loaded_(0)
+  , lazy_max_loaded_(0)
+  , lazy_bytes_(0)
+  , lazy_max_bytes_(0)
+  , update_depth_(0)
+  , update_value_(NULL)
+  , update_visible_(NULL)
+  , update_index_(-1)
+  , update_visible_index_(-1)
+  , model_(NULL)
+  , model_changed_(0)
+  , tab_tree(NULL)
   , tab_width(NULL)
-  , tab_labels(NULL)
-  , tab_count(0) {
+  , tab_label_offsets(NULL)
+  , tab_count(0)
+  , tree_count_(0)
+  , tab_capacity_(0)
+  , tab_arena_(NULL)
+  , label_pool_(NULL)
+  , label_pool_used_(0)
+  , label_pool_size_(0)
+  , label_pool_garbage_(0)
+  , tab_kids(NULL)
+  , tab_label_ptrs(NULL)
+  , tab_label_hashes(NULL)
+  , tab_fonts(NULL)
+  , tab_sizes(NULL)
+  , tab_estimated(NULL)
+  , layout_valid_(0)
+  , layout_button_width_(0)
+  , truncate_offsets_(NULL)
+  , truncate_widths_(NULL)
+  , truncate_capacity_(0)
+  , fixed_w_(0)
+  , fixed_label_(NULL)
+  , fixed_label_size_(0)
+  , layout_serial_(0)
+  , buffer_tabs_(0)
+  , strip_((Fl_Scroll_Tabs_Strip *)calloc(1, sizeof(Fl_Scroll_Tabs_Strip)))
+  , sprites_((Fl_Scroll_Tabs_Sprite *)calloc(SPRITE_COUNT, sizeof(Fl_Scroll_Tabs_Sprite)))
+  , hover_tab_(-1)
+  , hover_close_(0)
+  , reorderable_(0)
+  , drag_tab_(-1)
+  , drag_moved_(0)
+  , smooth_scroll_(1)
+  , scrolling_(0)
+  , scroll_time_(0.0)
+  , scroll_pos_(0.0)
+  , scroll_velocity_(0.0)
+  , scroll_target_(-1.0)
+  , find_(NULL)
+  , recorder_(NULL)
+  , queue_(NULL)
+  , async_(0)
+  , async_pending_(0)
+  , async_metrics_(NULL)
+  , async_job_(NULL) {
   box(FL_FLAT_BOX);
+#ifdef FL_SCROLL_TABS_STATS
+  reset_stats();
+  slow_cb_ = NULL;
+  slow_arg_ = NULL;
+  slow_threshold_ = 0.0;
+#endif
 }
 
 Fl_Scroll_Tabs::~Fl_Scroll_Tabs() {
-  if (pressed_)
-    Fl::remove_timeout(timeout_cb, this);
+  Fl::remove_timeout(timeout_cb, this);
+  cancel_async_job();
+  record_events(NULL);
+  if (queue_) {
+    queue_->detach();
+    queue_->release();
+  }
+  
+  // Loaded lazy tabs, ours or taken out of us, may be deleted after we are, so they must not tell us
+  while (lazy_first_)
+    lazy_unlink(lazy_first_);
     
   clear_tab_positions();
+  free(truncate_offsets_);
+  free(fixed_label_);
+  for (int k = 0; k<SPRITE_COUNT; k++) {
+    delete sprites_[k].bitmap;
+    free(sprites_[k].bits);
+  }
+  free(sprites_);
+  free(truncate_widths_);
+  if (find_) {
+    free(find_->order);
+    free(find_->keys);
+    free(find_->blocks);
+    free(find_->pool);
+    free(find_);
+  }
+  if (strip_->offscreen)
+    fl_delete_offscreen(strip_->offscreen);
+  free(strip_);
+}
+
+// FNV-1a hash of a label, used to notice labels whose text was changed in place.
+static unsigned label_hash(const char *l) {
+  unsigned h = 2166136261u;
+  if (l==NULL)
+    return 0;
+  while (*l) {
+    h ^= (unsigned char)*l++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Bytes each tab takes in the arena holding the per-tab arrays
+#define TAB_ARENA_STRIDE (2*sizeof(void *)+3*sizeof(int)+sizeof(unsigned)+sizeof(Fl_Font)+sizeof(Fl_Fontsize)+sizeof(unsigned char))
+
+// Carve the next array of `n' elements of type T out of the arena at `p', copying `used' of them from `old'.
+template <class T> static T *arena_array(char *&p, int n, const T *old, int used) {
+  T *const a = (T *)p;
+  if (used)
+    memcpy(a, old, used*sizeof(T));
+  p += n*sizeof(T);
+  return a;
+}
+
+/*
+  Make room in the per-tab arrays for at least `n' tabs. They grow by at
+  least half again, so adding tabs one at a time doesn't reallocate each time.
+  All of them live in a single block, pointers first so that each array is aligned.
+*/
+void Fl_Scroll_Tabs::reserve_tab_arrays(int n) {
+  if (n<=tab_capacity_)
+    return;
+  if (n<tab_capacity_+(tab_capacity_>>1))
+    n = tab_capacity_+(tab_capacity_>>1);
+  
+  char *const arena = (char *)malloc(n*TAB_ARENA_STRIDE);
+  char *p = arena;
+  tab_kids = arena_array(p, n, tab_kids, tab_count);
+  tab_label_ptrs = arena_array(p, n, tab_label_ptrs, tab_count);
+  tab_tree = arena_array(p, n, tab_tree, tab_count);
+  tab_width = arena_array(p, n, tab_width, tab_count);
+  tab_label_offsets = arena_array(p, n, tab_label_offsets, tab_count);
+  tab_label_hashes = arena_array(p, n, tab_label_hashes, tab_count);
+  tab_fonts = arena_array(p, n, tab_fonts, tab_count);
+  tab_sizes = arena_array(p, n, tab_sizes, tab_count);
+  tab_estimated = arena_array(p, n, tab_estimated, tab_count);
+  
+  free(tab_arena_);
+  tab_arena_ = arena;
+  tab_capacity_ = n;
+}
+
+/*
+  Give tab `i' room for a label of `n' bytes at the end of the label pool.
+  The tab's old label becomes garbage, collected by compact_labels().
+  The space is valid until the next call, which may move the pool.
+*/
+char *Fl_Scroll_Tabs::label_space(int i, int n) {
+  if (tab_label_offsets[i]>=0)
+    label_pool_garbage_ += strlen(label_pool_+tab_label_offsets[i])+1;
+  
+  if (label_pool_used_+n>label_pool_size_) {
+    int size = label_pool_size_+(label_pool_size_>>1);
+    if (size<label_pool_used_+n)
+      size = label_pool_used_+n;
+    if (size<256)
+      size = 256;
+    label_pool_ = (char *)realloc(label_pool_, size);
+    label_pool_size_ = size;
+  }
+  
+  tab_label_offsets[i] = label_pool_used_;
+  label_pool_used_ += n;
+  return label_pool_+tab_label_offsets[i];
+}
+
+/*
+  Give back the end of the space label_space() gave tab `i' that its label didn't use.
+*/
+void Fl_Scroll_Tabs::label_fit(int i) {
+  const int end = tab_label_offsets[i]+strlen(label_pool_+tab_label_offsets[i])+1;
+  if (end<label_pool_used_)
+    label_pool_used_ = end;
+}
+
+/*
+  Once most of the label pool is labels no tab uses any more, copy the
+  ones still used to a new pool, in tab order.
+*/
+void Fl_Scroll_Tabs::compact_labels() {
+  if ((label_pool_garbage_<1024) || (label_pool_garbage_<(label_pool_used_>>1)))
+    return;
+  
+  const int used = label_pool_used_-label_pool_garbage_;
+  char *const pool = (char *)malloc(used+(used>>2)+1);
+  int at = 0;
+  for (int i = 0; i<tab_count; i++) {
+    if (tab_label_offsets[i]<0)
+      continue;
+    const char *const l = label_pool_+tab_label_offsets[i];
+    const int n = strlen(l)+1;
+    memcpy(pool+at, l, n);
+    tab_label_offsets[i] = at;
+    at += n;
+  }
+  
+  free(label_pool_);
+  label_pool_ = pool;
+  label_pool_size_ = used+(used>>2)+1;
+  label_pool_used_ = at;
+  label_pool_garbage_ = 0;
+}
+
+// Forget the labels of the tabs from `n' on
+void Fl_Scroll_Tabs::drop_tabs(int n) {
+  while (tab_count>n) {
+    tab_count--;
+    find_removed(tab_count);
+    if (tab_label_offsets[tab_count]>=0)
+      label_pool_garbage_ += strlen(label_pool_+tab_label_offsets[tab_count])+1;
+  }
+  if (tree_count_>tab_count)
+    tree_count_ = tab_count;
+}
+
+// Hash of a child's address, for finding where a moved child was laid out
+static unsigned pointer_hash(const void *p) {
+  const unsigned h = (unsigned)(((size_t)p)>>4)*2654435761u;
+  return h^(h>>15);
+}
+
+/*
+  The children from `first' on are not the ones laid out there, because
+  children were inserted, removed or reordered. Move the measurements of
+  the children that are still here to where they are now, so that only
+  the children that were added need to be measured.
+*/
+void Fl_Scroll_Tabs::adopt_moved_tabs(int first, int n) {
+  const int old_n = tab_count-first;
+  
+  // Copy what was laid out from `first' on, in the same layout as the arena
+  char *const saved = (char *)malloc(old_n*TAB_ARENA_STRIDE);
+  char *p = saved;
+  Fl_Widget **const kids = arena_array(p, old_n, tab_kids+first, old_n);
+  const char **const label_ptrs = arena_array(p, old_n, tab_label_ptrs+first, old_n);
+  int *const widths = arena_array(p, old_n, tab_width+first, old_n);
+  int *const label_offsets = arena_array(p, old_n, tab_label_offsets+first, old_n);
+  unsigned *const hashes = arena_array(p, old_n, tab_label_hashes+first, old_n);
+  Fl_Font *const fonts = arena_array(p, old_n, tab_fonts+first, old_n);
+  Fl_Fontsize *const sizes = arena_array(p, old_n, tab_sizes+first, old_n);
+  unsigned char *const estimated = arena_array(p, old_n, tab_estimated+first, old_n);
+  
+  // Where each of those children was, by open addressing
+  int size = 16;
+  while (size<(old_n<<1))
+    size <<= 1;
+  int *const table = (int *)malloc(size*sizeof(int));
+  for (int h = 0; h<size; h++)
+    table[h] = -1;
+  for (int k = 0; k<old_n; k++) {
+    unsigned h = pointer_hash(kids[k])&(size-1);
+    while (table[h]>=0)
+      h = (h+1)&(size-1);
+    table[h] = k;
+  }
+  
+  reserve_tab_arrays(n);
+  for (int j = first; j<n; j++) {
+    Fl_Widget *const kid = child(j);
+    int k = -1;
+    for (unsigned h = pointer_hash(kid)&(size-1); table[h]>=0; h = (h+1)&(size-1)) {
+      if (kids[table[h]]==kid) {
+        k = table[h];
+        break;
+      }
+    }
+    
+    if (k<0) {
+      // Added, so it must be measured, and might not have been hidden
+      tab_kids[j] = NULL;
+      tab_label_offsets[j] = -1;
+      tab_width[j] = 0;
+      tab_estimated[j] = 0;
+      value_children_ = -1;
+      continue;
+    }
+    
+    tab_kids[j] = kid;
+    tab_label_ptrs[j] = label_ptrs[k];
+    tab_width[j] = widths[k];
+    tab_label_offsets[j] = label_offsets[k];
+    tab_label_hashes[j] = hashes[k];
+    tab_fonts[j] = fonts[k];
+    tab_sizes[j] = sizes[k];
+    tab_estimated[j] = estimated[k];
+    kids[k] = NULL;
+  }
+  
+  // The labels of the children that were removed
+  for (int k = 0; k<old_n; k++) {
+    if (kids[k] && (label_offsets[k]>=0))
+      label_pool_garbage_ += strlen(label_pool_+label_offsets[k])+1;
+  }
+  
+  tab_count = n;
+  if (tree_count_>first)
+    tree_count_ = first;
+  // Background measuring finds the tabs by their index
+  cancel_async_job();
+  // The tabs in the find index are numbered
+  if (find_)
+    find_->valid = 0;
+  
+  free(table);
+  free(saved);
+}
+
+/*
+  Measure tab `i' again if anything it was measured from changed, or always
+  if `relayout' is set. If `estimate' is set, only guess its width and leave
+  the measuring to start_async_job(). Returns non-zero if it was measured.
+*/
+int Fl_Scroll_Tabs::measure_tab(int i, int relayout, int estimate) {
+  // A model's tabs have no widgets, and use our label font
+  Fl_Widget *const kid = model_?NULL:child(i);
+  const char *const label = model_?model_->label(i):kid->label();
+  const Fl_Font font = model_?labelfont():kid->labelfont();
+  const Fl_Fontsize size = model_?labelsize():kid->labelsize();
+  const unsigned hash = label_hash(label);
+  
+  if (!relayout && (tab_kids[i]==kid) && (tab_label_ptrs[i]==label) && (tab_label_hashes[i]==hash) &&
+      (tab_fonts[i]==font) && (tab_sizes[i]==size) && (tab_label_offsets[i]>=0))
+    return 0;
+  
+  // A different child here might have been added without being hidden
+  if (tab_kids[i]!=kid)
+    value_children_ = -1;
+  
+  if ((tab_label_offsets[i]<0) || (tab_kids[i]!=kid) || (tab_label_ptrs[i]!=label) || (tab_label_hashes[i]!=hash))
+    find_changed(i, label);
+  
+  const int tab_label_padding = Fl::box_dw(FL_DOWN_BOX)+(TAB_SELECTION_BORDER<<1)+(closebutton_?button_width_:0);
+  const int old_width = tab_width[i];
+  const int model_width = model_?model_->width(i):-1;
+  if (fixed_w_) {
+    // Cut to fit when drawn, see fixed_label()
+    const int len = label?strlen(label):0;
+    memcpy(label_space(i, len+1), label?label:"", len+1);
+    tab_estimated[i] = 0;
+  }
+  else if (model_width>=0) {
+    // The model knows the width, so the label is only copied to be drawn.
+    const int len = label?strlen(label):0;
+    memcpy(label_space(i, len+1), label?label:"", len+1);
+    tab_width[i] = model_width+tab_label_padding;
+    tab_estimated[i] = 0;
+  }
+  else if (estimate) {
+    tab_width[i] = estimated_label_length(i, label, font, size)+tab_label_padding;
+    tab_estimated[i] = 1;
+    async_pending_ = 1;
+  }
+  else {
+    tab_width[i] = tab_label_length(i, label, font, size)+tab_label_padding;
+    tab_estimated[i] = 0;
+  }
+  if (!fixed_w_)
+    tree_add(i, tab_width[i]-old_width);
+  
+  tab_kids[i] = kid;
+  tab_label_ptrs[i] = label;
+  tab_label_hashes[i] = hash;
+  tab_fonts[i] = font;
+  tab_sizes[i] = size;
+  return 1;
+}
+
+/*
+  The offsets of the tabs are kept as a Fenwick tree over their widths:
+  tab_tree[i] is the sum of the widths of tabs (i&(i+1)) to i. A tab's offset
+  is found, and a change to one tab's width is made, in O(log n), instead of
+  moving every tab after it.
+*/
+
+// The offset of tab `i' in the laid out strip, which is the sum of the widths before it
+long Fl_Scroll_Tabs::tab_start(int i) const {
+  if (fixed_w_)
+    return (long)i*fixed_w_;
+  long x = 0;
+  for (i--; i>=0; i = (i&(i+1))-1)
+    x += tab_tree[i];
+  return x;
+}
+
+// Tab `i' got `d' pixels wider. Tabs not in the tree yet are added by update_tree().
+void Fl_Scroll_Tabs::tree_add(int i, int d) {
+  for (; i<tree_count_; i|=i+1)
+    tab_tree[i] += d;
+}
+
+// Add the tabs from tree_count_ on to the tree
+void Fl_Scroll_Tabs::update_tree() {
+  if ((tree_count_==0) || ((tab_count-tree_count_)*16>tab_count)) {
+    // Make it all again, which is O(n)
+    for (int i = 0; i<tab_count; i++)
+      tab_tree[i] = tab_width[i];
+    for (int i = 0; i<tab_count; i++) {
+      const int parent = i|(i+1);
+      if (parent<tab_count)
+        tab_tree[parent] += tab_tree[i];
+    }
+  }
+  else {
+    // Only entries before a tab's go into its entry, so a few added tabs are O(log n) each.
+    for (int i = tree_count_; i<tab_count; i++)
+      tab_tree[i] = tab_width[i]+tab_start(i)-tab_start(i&(i+1));
+  }
+  tree_count_ = tab_count;
 }
 
 int Fl_Scroll_Tabs::tab_positions() {
+#ifdef FL_SCROLL_TABS_STATS
+  Fl_Scroll_Tabs_Timer timer(this, 0);
+#endif
 
-  if (!children())
+  const int n = tabs();
+  
+  if (!n) {
+    drop_tabs(0);
+    compact_labels();
+    return 0;
+  }
+  
+  // Wait for end_update(), unless there is nothing to use until then
+  if (update_depth_ && tab_count)
     return 0;
 
-  if (tab_count!=children()) {
-    
-    while (tab_count>children()) {
-      tab_count--;
-      free(tab_labels[tab_count]);
+  // A change to any of these invalidates every tab. Our width is not one of them,
+  // so resizing a window keeps every measured width.
+  const int relayout = !layout_valid_ || (layout_button_width_!=button_width_);
+  
+  // Labels are only read again when tabs are added, removed or moved, or said to
+  // have changed. Otherwise only the children given new labels are measured.
+  if (!model_changed_ && !relayout && (tab_count==n)) {
+    const int relabelled = model_?0:relabelled_tabs();
+    if (relabelled>0) {
+      layout_serial_++;
+      compact_labels();
+      STAT(layouts);
     }
+    if (relabelled>=0)
+      return 0;
+  }
+  
+  if (find_)
+    find_->changes = 0;
+  
+  // Measurements being made for the old layout would be out of date
+  if (relayout)
+    cancel_async_job();
+  const int old_count = tab_count;
+  
+  // Children inserted or removed before others move the others to new places
+  if (!model_) {
+    const int m = (tab_count<n)?tab_count:n;
+    int first = 0;
+    while ((first<m) && (tab_kids[first]==child(first)))
+      first++;
+    if (first<m)
+      adopt_moved_tabs(first, n);
+    // Where the children are gives the tab height
+    if ((first<m) || (tab_count!=n))
+      tab_height_h_ = -1;
+  }
+  
+  if (tab_count!=n) {
+    
+    drop_tabs(n);
   
-    tab_pos   = (int *)realloc(tab_pos, children()*sizeof(int));
-    tab_width = (int *)realloc(tab_width, children()*sizeof(int));
-    tab_labels = (char**)realloc(tab_labels, children()*sizeof(const char *));
+    reserve_tab_arrays(n);
     
-    // Clear all added tab_labels elements so that they can be realloc'ed
-    while (tab_count<children()) {
-      tab_labels[tab_count] = NULL;
+    // Mark the new tabs as never measured.
+    while (tab_count<n) {
+      tab_label_offsets[tab_count] = -1;
+      tab_kids[tab_count] = NULL;
+      tab_width[tab_count] = 0;
+      tab_estimated[tab_count] = 0;
       tab_count++;
     }
   }
   
-  const int tab_label_padding = Fl::box_dw(FL_DOWN_BOX)+(TAB_SELECTION_BORDER<<1)+(closebutton_?button_width_:0);
+  // Every width changes, so add them up again once they are measured.
+  // Fixed width tabs need no tree.
+  if (relayout || fixed_w_)
+    tree_count_ = 0;
+  
+  // Measuring many tabs at once would keep the user waiting, so guess
+  // their widths for now and measure them in the background.
+  const int estimate = async_ && !fixed_w_ && ((relayout?tab_count:tab_count-old_count)>=ASYNC_MINIMUM_TABS);
+  
+  int changed = (tab_count!=old_count);
+  for (int i = 0; i<tab_count; i++) {
+    if (measure_tab(i, relayout, estimate))
+      changed = 1;
+  }
+  
+  if (async_pending_ && !async_job_)
+    start_async_job();
   
-  tab_width[0] = tab_label_length(0)+tab_label_padding;
-  tab_pos[0] = 0;
+  if (!fixed_w_ && (tree_count_<tab_count)) {
+    update_tree();
+    changed = 1;
+  }
   
-  for (int i = 1; i<tab_count; i++) {
-    tab_width[i] = tab_label_length(i)+tab_label_padding;
-    tab_pos[i] = tab_width[i-1] + tab_pos[i-1];
+  if (changed) {
+    layout_serial_++;
+    compact_labels();
+    STAT(layouts);
   }
   
+  layout_valid_ = 1;
+  model_changed_ = 0;
+  layout_button_width_ = button_width_;
+  
   return 0;
 }
 
-int Fl_Scroll_Tabs::tab_label_length(int i) {
+/*
+  Measure again the children whose label, font or size was set since the last
+  layout, which reads a few pointers of each child rather than its label.
+  Returns how many were, or -1 if children were added, removed or moved.
+*/
+int Fl_Scroll_Tabs::relabelled_tabs() {
+  if (children()!=tab_count)
+    return -1;
+  Fl_Widget *const *const a = array();
+  int n = 0;
+  for (int i = 0; i<tab_count; i++) {
+    const Fl_Widget *const kid = a[i];
+    if (kid!=tab_kids[i])
+      return -1;
+    if ((kid->label()==tab_label_ptrs[i]) && (kid->labelfont()==tab_fonts[i]) && (kid->labelsize()==tab_sizes[i]))
+      continue;
+    if (!n && find_)
+      find_->changes = 0;
+    n += measure_tab(i, 0, 0);
+  }
+  return n;
+}
+
+/*
+  Glyph advances shared by every Fl_Scroll_Tabs, so that labels in the same
+  font are measured once per character rather than once per label and tab bar.
+  The cache is direct mapped: a glyph that hashes to a used slot replaces it,
+  which keeps the cache at a fixed size.
+*/
+#define GLYPH_CACHE_SIZE 4096
+#define ELLIPSIS_GLYPH 0xFFFFFFFFu  // Not a codepoint. Caches the width of "..."
+
+struct Fl_Scroll_Tabs_Glyph {
+  Fl_Font font;
+  Fl_Fontsize size;
+  unsigned codepoint;
+  int used;
+  double advance;
+};
+
+static Fl_Scroll_Tabs_Glyph *glyph_cache = NULL;
+static int glyph_cache_slots = GLYPH_CACHE_SIZE, glyph_cache_entries = 0;
+static unsigned long glyph_cache_hits = 0, glyph_cache_misses = 0;
+
+// Sets the font in `font_set' the first time a glyph has to actually be measured.
+static double glyph_advance(Fl_Font font, Fl_Fontsize size, unsigned c, int &font_set) {
+  if (glyph_cache==NULL)
+    glyph_cache = (Fl_Scroll_Tabs_Glyph *)calloc(glyph_cache_slots, sizeof(Fl_Scroll_Tabs_Glyph));
+
+  const unsigned hash = (c*2654435761u)^((unsigned)font*40503u)^((unsigned)size*9176u);
+  Fl_Scroll_Tabs_Glyph *const glyph = glyph_cache+((hash^(hash>>15))&(glyph_cache_slots-1));
+  
+  if (glyph->used && (glyph->codepoint==c) && (glyph->font==font) && (glyph->size==size)) {
+    glyph_cache_hits++;
+    return glyph->advance;
+  }
+  
+  glyph_cache_misses++;
+  if (!font_set) {
+    fl_font(font, size);
+    font_set = 1;
+  }
+  
+  if (!glyph->used)
+    glyph_cache_entries++;
+  glyph->font = font;
+  glyph->size = size;
+  glyph->codepoint = c;
+  glyph->used = 1;
+  glyph->advance = (c==ELLIPSIS_GLYPH)?fl_width("..."):fl_width(c);
+  return glyph->advance;
+}
+
+void Fl_Scroll_Tabs::glyph_cache_size(int n) {
+  int slots = 1;
+  while (slots<n)
+    slots<<=1;
+  
+  free(glyph_cache);
+  glyph_cache = NULL;
+  glyph_cache_slots = slots;
+  glyph_cache_entries = 0;
+}
+
+int Fl_Scroll_Tabs::glyph_cache_size() {
+  return glyph_cache_slots;
+}
+
+void Fl_Scroll_Tabs::glyph_cache_stats(unsigned long &hits, unsigned long &misses, int &entries) {
+  hits = glyph_cache_hits;
+  misses = glyph_cache_misses;
+  entries = glyph_cache_entries;
+}
+
+void Fl_Scroll_Tabs::clear_glyph_cache() {
+  glyph_cache_size(glyph_cache_slots);
+  glyph_cache_hits = glyph_cache_misses = 0;
+}
 
-  Fl_Widget *kid = child(i);
-  if(kid->label()==NULL){
-      tab_labels[i] = (char *)realloc(tab_labels[i], 1);
-      tab_labels[i][0] = '\0';
+// fl_measure() expands tabs, control characters and shortcuts, so only labels without them can be summed from glyph advances.
+static int plain_label(const char *l) {
+  for (; *l; l++) {
+    const unsigned char c = *l;
+    if ((c<' ') || (c==127) || (c=='&'))
       return 0;
   }
+  return 1;
+}
+
+int Fl_Scroll_Tabs::label_cuts(const char *label_, int label_len) {
+  if (truncate_capacity_<label_len) {
+    truncate_capacity_ = label_len;
+    truncate_offsets_ = (int *)realloc(truncate_offsets_, truncate_capacity_*sizeof(int));
+    truncate_widths_ = (double *)realloc(truncate_widths_, truncate_capacity_*sizeof(double));
+  }
+  int n_cuts = 0;
+  const char *end = label_+label_len;
+  do {
+    truncate_offsets_[n_cuts++] = end-label_;
+    end = fl_utf8back(end-1, label_, end);
+  } while (end!=label_);
+  return n_cuts;
+}
+
+int Fl_Scroll_Tabs::cached_label_width(char *label_, int label_len, Fl_Font font, Fl_Fontsize size, int max_w) {
+  int font_set = 0;
+  const int n_cuts = label_cuts(label_, label_len);
+  
+  // Width of the label up to each cut, summed from the glyph before each cut.
+  double sum = 0.0;
+  for (int i = n_cuts-1; i>=0; i--) {
+    const int from = (i==n_cuts-1)?0:truncate_offsets_[i+1];
+    int len;
+    const unsigned c = fl_utf8decode(label_+from, label_+truncate_offsets_[i], &len);
+    if (len!=truncate_offsets_[i]-from)
+      return -1; // Not a single character, leave it to fl_measure
+    sum+=glyph_advance(font, size, c, font_set);
+    truncate_widths_[i] = sum;
+  }
+  
+  // fl_measure() rounds up
+  const int full_w = (int)ceil(truncate_widths_[0]);
+  if ((max_w==-1) || (full_w<max_w))
+    return full_w;
   
-  fl_font(kid->labelfont(), kid->labelsize());
+  const double ellipsis = glyph_advance(font, size, ELLIPSIS_GLYPH, font_set);
+  int first = 0, last = n_cuts;
+  while (first<last) {
+    const int mid = first+((last-first)>>1);
+    STAT(truncation_steps);
+    if ((int)ceil(truncate_widths_[mid]+ellipsis)<max_w)
+      last = mid;
+    else
+      first = mid+1;
+  }
+  if (first==n_cuts)
+    first = n_cuts-1;
+  
+  strcpy(label_+truncate_offsets_[first], "...");
+  return (int)ceil(truncate_widths_[first]+ellipsis);
+}
 
-  const char * const label_a = kid->label();
-  int label_len = strlen(label_a);
-  // Three extra to hold an ellipse if necessary. 
-  // Not 4 for a null+ellipse, since ellipse is only appended if the string is truncated.
-  char *label_ = (char *)realloc(tab_labels[i], label_len+3);
-  memcpy(label_, label_a, label_len+1);
+int Fl_Scroll_Tabs::measured_label_width(char *label_, int label_len, Fl_Font font, Fl_Fontsize size, int max_w) {
+  fl_font(font, size);
 
   int s_w = 0, s_h;
   
+  STAT(measures);
   fl_measure(label_, s_w, s_h, 0);
   
-  if (maximum_tab_width_!=-1) {
-    char *end = label_+label_len;
-    const int effective_max = maximum_tab_width_-((closebutton_)?button_width_:0);
-    while ((end!=label_) && (s_w>=effective_max)) {
-      
-      strcpy(end, "...");
+  if ((max_w!=-1) && (s_w>=max_w)) {
       
+    // The places the label may be cut, longest first. These are the same
+    // places stepping back one character at a time would try.
+    const int n_cuts = label_cuts(label_, label_len);
+    
+    // Labels only get narrower as they are cut shorter, so binary search
+    // for the longest cut that fits. If none fit, use the shortest.
+    int first = 0, last = n_cuts, fit_w = 0, last_w = -1;
+    while (first<last) {
+      const int mid = first+((last-first)>>1);
+      strcpy(label_+truncate_offsets_[mid], "...");
+      STAT(truncation_steps);
       s_w = 0;
-      
+      STAT(measures);
+      fl_measure(label_, s_w, s_h, 0);
+      if (mid==n_cuts-1)
+        last_w = s_w;
+      if (s_w<max_w) {
+        last = mid;
+        fit_w = s_w;
+      }
+      else
+        first = mid+1;
+    }
+    
+    if (first==n_cuts)
+      first = n_cuts-1;
+    else
+      last_w = fit_w;
+    
+    strcpy(label_+truncate_offsets_[first], "...");
+    if (last_w<0) {
+      s_w = 0;
+      STAT(measures);
       fl_measure(label_, s_w, s_h, 0);
-      
-      end = (char *)fl_utf8back(end-1, label_, end);
     }
+    else
+      s_w = last_w;
+  }
+  
+  return s_w;
+}
+
+int Fl_Scroll_Tabs::tab_label_length(int i, const char *label_a, Fl_Font font, Fl_Fontsize size) {
+
+  if(label_a==NULL){
+      label_space(i, 1)[0] = '\0';
+      return 0;
+  }
+  
+  int label_len = strlen(label_a);
+  // Four extra to hold an ellipse and its null if necessary.
+  char *label_ = label_space(i, label_len+4);
+  memcpy(label_, label_a, label_len+1);
+
+  const int effective_max = maximum_label_width();
+  
+  int s_w = 0;
+  if (label_len!=0) {
+    if (plain_label(label_))
+      s_w = cached_label_width(label_, label_len, font, size, effective_max);
+    if (s_w<=0)
+      s_w = measured_label_width(label_, label_len, font, size, effective_max);
+  }
+  
+  label_fit(i);
+  
+  return minimum_label_width(s_w);
+}
+
+const char *Fl_Scroll_Tabs::fixed_label(int i) {
+  const char *const label = tab_label(i);
+  const int len = strlen(label);
+  const int max_w = fixed_w_-Fl::box_dw(FL_DOWN_BOX)-(TAB_SELECTION_BORDER<<1)-(closebutton_?button_width_:0);
+  if (!len || (max_w<=0))
+    return "";
+  
+  // Four extra to hold an ellipse and its null if necessary.
+  if (fixed_label_size_<len+4) {
+    fixed_label_size_ = len+4;
+    fixed_label_ = (char *)realloc(fixed_label_, fixed_label_size_);
   }
+  memcpy(fixed_label_, label, len+1);
+  
+  int s_w = 0;
+  if (plain_label(fixed_label_))
+    s_w = cached_label_width(fixed_label_, len, tab_fonts[i], tab_sizes[i], max_w);
+  if (s_w<=0)
+    measured_label_width(fixed_label_, len, tab_fonts[i], tab_sizes[i], max_w);
   
+  // Measuring may have changed the font the tabs are drawn with
+  fl_font(labelfont(), labelsize());
+  return fixed_label_;
+}
+
+// The width a label must be narrower than to fit in a tab, or -1 for any width
+int Fl_Scroll_Tabs::maximum_label_width() const {
+  return (maximum_tab_width_==-1)?-1:maximum_tab_width_-((closebutton_)?button_width_:0);
+}
+
+// Widen a label's width to the minimum tab width
+int Fl_Scroll_Tabs::minimum_label_width(int s_w) const {
   if (closebutton_ && (s_w<minimum_tab_width_-button_width_)) {
     s_w = minimum_tab_width_-button_width_;
   }
   else if (s_w<minimum_tab_width_) {
      s_w = minimum_tab_width_;
   } 
+  return s_w;
+}
 
-  tab_labels[i] = label_;
+/*
+  Guess the width of tab `i''s label from the number of characters in it,
+  without measuring it. The whole label is kept to be drawn until it is measured.
+*/
+int Fl_Scroll_Tabs::estimated_label_length(int i, const char *label, Fl_Font font, Fl_Fontsize size) {
+  const int len = label?strlen(label):0;
+  memcpy(label_space(i, len+1), label?label:"", len+1);
   
-  return s_w;
+  int chars = 0;
+  for (int k = 0; k<len; k++) {
+    if ((label[k]&0xC0)!=0x80)
+      chars++;
+  }
+  
+  int font_set = 0;
+  int s_w = (int)ceil(chars*glyph_advance(font, size, 'n', font_set));
+  const int effective_max = maximum_label_width();
+  if ((effective_max!=-1) && (s_w>=effective_max))
+    s_w = effective_max-1;
+  return minimum_label_width(s_w);
 }
 
 void Fl_Scroll_Tabs::clear_tab_positions() {
-  if (tab_count==0)
-    return;
-
-  free(tab_pos);
-  free(tab_width);
+  free(tab_arena_);
+  tab_arena_ = NULL;
+  tab_tree = tab_width = tab_label_offsets = NULL;
+  tab_estimated = NULL;
+  tab_kids = NULL;
+  tab_label_ptrs = NULL;
+  tab_label_hashes = NULL;
+  tab_fonts = NULL;
+  tab_sizes = NULL;
   tab_count = 0;
+  tab_capacity_ = 0;
+  tree_count_ = 0;
+  
+  free(label_pool_);
+  label_pool_ = NULL;
+  label_pool_used_ = label_pool_size_ = label_pool_garbage_ = 0;
+  layout_valid_ = 0;
 }
 
 Fl_Widget *Fl_Scroll_Tabs::push() const {
@@ -136,23 +1013,51 @@ Fl_Widget *Fl_Scroll_Tabs::push() const {
 }
 
 int Fl_Scroll_Tabs::push(Fl_Widget *w) {
+  // A model's only child is the selected tab's content
+  if (model_)
+    return ensure_value();
+  
+  // Something that isn't a child, or NULL, selects the first tab, as it always has
+  const int i = find(w);
+  return push((i<children())?i:0);
+}
+
+int Fl_Scroll_Tabs::push(int i) {
+  const int n = tabs();
+  if (n==0)
+    return 0;
+  if ((i<0) || (i>=n))
+    i = n-1;
+  
+  if (update_depth_) {
+    if (model_)
+      update_index_ = i;
+    else
+      update_value_ = child(i);
+    return i;
+  }
+  
+  ensure_value();
   Fl_Widget *const old_value = value_;
-  value_ = w;
-  const int c = ensure_value();
-  if (value_ && (value_!=old_value)) {
+  select(i);
+  if (value_!=old_value) {
     if (when()&FL_WHEN_CHANGED)
       do_callback(); 
-    redraw();
+    // Showing the new group redraws it
+    redraw_tabs();
   }
   else { 
     value_->set_visible_focus();
   }
-  make_tab_visible(c);
-  return c;
+  make_tab_visible(i);
+  return i;
 }
 
 int Fl_Scroll_Tabs::handle(int e) {
   
+  if (recorder_)
+    record_event(e);
+  
   ensure_value();
 
   switch (e) {
@@ -180,68 +1085,135 @@ int Fl_Scroll_Tabs::handle(int e) {
         }
         else{
           pressed_ = 0;
+          // Take the keys typed to find a tab
+          if (Fl::visible_focus() && visible_focus() && (Fl::focus()!=this))
+            Fl::focus(this);
+          
+          drag_tab_ = -1;
+          drag_moved_ = 0;
+          if (reorderable_ && !model_) {
+            const int n_kid = which_tab(Fl::event_x(), Fl::event_y());
+            if ((n_kid>=0) && !over_close_button(n_kid, Fl::event_x()))
+              drag_tab_ = n_kid;
+          }
         }
 
         if (inside_left_button || inside_right_button) {
-          Fl::add_timeout(INITIALREPEAT, timeout_cb, this);
+          redraw_buttons();
+          start_scrolling(INITIALREPEAT);
+          return 1;
+        }
+      }
+      if (e==FL_MOUSEWHEEL) {
+        const int notches = Fl::event_dx()?Fl::event_dx():Fl::event_dy();
+        if (notches) {
+          wheel_scroll(notches);
           return 1;
         }
       }
+      if ((e==FL_DRAG) && (drag_tab_>=0)) {
+        tab_positions();
+        const long event_x = Fl::event_x()+(long)offset-button_width_;
+        // Pass a neighbour once the mouse is past its middle. The dragged tab then
+        // covers the mouse, so tabs of different widths don't swap back and forth.
+        long start = tab_start(drag_tab_);
+        int to = drag_tab_;
+        while ((to<tab_count-1) && (event_x>start+tab_w(drag_tab_)+(tab_w(to+1)>>1))) {
+          start += tab_w(to+1);
+          to++;
+        }
+        while ((to>0) && (event_x<start-(tab_w(to-1)>>1))) {
+          start -= tab_w(to-1);
+          to--;
+        }
+        if (to!=drag_tab_) {
+          move_tab(drag_tab_, to);
+          drag_tab_ = to;
+          drag_moved_ = 1;
+          make_tab_visible(to);
+        }
+      }
+      if ((e==FL_MOVE) || (e==FL_DRAG)) {
+        const int n_kid = (inside_left_button || inside_right_button)?-1:which_tab(Fl::event_x(), Fl::event_y());
+        hover(n_kid, (n_kid>=0) && over_close_button(n_kid, Fl::event_x()));
+      }
       if (e==FL_RELEASE) {
         // We need to redraw the scroll button
-        if (pressed_!=-1)
-          redraw();
+        if (pressed_>0)
+          redraw_buttons();
         if(pressed_>0){
-            Fl::remove_timeout(timeout_cb, this);
             tab_positions();
-            if(pressed_==1){
-                for(int i = 0; i<tab_count; i++){
-                    if((offset>=tab_pos[i]) && (offset<=tab_width[i]+tab_pos[i])){
-                        make_tab_visible(i);
-                        break;
-                    }
-                }
-            }
-            else if(pressed_==2){
-                const int far_edge = offset+w()-(button_width_<<1);
-                for(int i = 0; i<tab_count; i++){
-                    if((far_edge>=tab_pos[i]) && (far_edge<=tab_width[i]+tab_pos[i])){
-                        make_tab_visible(i);
-                        break;
-                    }
-                }
-            }
+            // Snap to the tab cut off by the edge we were scrolling towards
+            const int snap = (pressed_==1)?tab_at(offset):tab_at(offset+w()-(button_width_<<1));
+            if(snap>=0)
+                make_tab_visible(snap);
         }
         pressed_ = -1;
+        
+        // A dragged tab is selected wherever it is let go
+        const int dragged = drag_moved_?drag_tab_:-1;
+        drag_tab_ = -1;
+        drag_moved_ = 0;
+        if (dragged>=0) {
+          push(dragged);
+          return 1;
+        }
 
         if (!(inside_left_button || inside_right_button)) { // Mouse is inside the tab bar itself
-          Fl_Widget *const kid = which(Fl::event_x(), Fl::event_y());
-          if (!kid)
+          const int n_kid = which_tab(Fl::event_x(), Fl::event_y());
+          if (n_kid<0)
+            return 1;
+          if (closebutton_ && model_) {
+            if (over_close_button(n_kid, Fl::event_x())) {
+              if (model_->close(n_kid))
+                model_closed(n_kid);
+              hover(-1, 0);
+              redraw_tabs();
+            }
+            else
+              push(n_kid);
             return 1;
+          }
+          Fl_Widget *const kid = model_?NULL:child(n_kid);
           if (closebutton_) {
-            const int n_kid = find(kid),
-              hotspot_x = tab_pos[n_kid]+tab_width[n_kid];
-            if((Fl::event_x()+offset-button_width_ >= hotspot_x-button_width_) && (Fl::event_x()+offset-button_width_ <= hotspot_x)) {
+            if (over_close_button(n_kid, Fl::event_x())) {
+              Fl_Widget *closed_kid = kid;
               remove(kid);
-              if (close_callback_)
-                close_callback_(kid, close_callback_arg_);
+              lazy_removed(kid);
+              closed(&closed_kid, 1);
               ensure_value();
-              redraw();
+              hover(-1, 0);
+              redraw_tabs();
             }
             else
-              push(kid);
+              push(n_kid);
           }
           else
-            push(kid);
+            push(n_kid);
           return 1;
         }
       }
     } // Is withing tab bar
-    else if ((e==FL_PUSH) || (e==FL_RELEASE)) {
-      if (pressed_)
-        redraw();
-      pressed_=-1;
+    else {
+      if ((e==FL_PUSH) || (e==FL_RELEASE)) {
+        if (pressed_>0)
+          redraw_buttons();
+        pressed_=-1;
+        if (drag_moved_ && (e==FL_RELEASE))
+          push(drag_tab_);
+        drag_tab_ = -1;
+        drag_moved_ = 0;
+      }
+      hover(-1, 0);
     }
+    break;
+    case FL_LEAVE:
+      hover(-1, 0);
+    break;
+    case FL_KEYBOARD:
+      if ((Fl::focus()==this) && handle_key())
+        return 1;
+    break;
   }
 
   
@@ -251,10 +1223,16 @@ int Fl_Scroll_Tabs::handle(int e) {
 }
 
 void Fl_Scroll_Tabs::draw() {
+#ifdef FL_SCROLL_TABS_STATS
+  Fl_Scroll_Tabs_Timer timer(this, 1);
+#endif
+  const unsigned char d = damage();
+
   // Draw our box
-  fl_draw_box(box(), x(), y(), w(), h(), color());
+  if (d&FL_DAMAGE_ALL)
+    fl_draw_box(box(), x(), y(), w(), h(), color());
 
-  if (!children())
+  if (!tabs())
     return;
 
   const int X = x()+Fl::box_dx(box()),
@@ -265,125 +1243,284 @@ void Fl_Scroll_Tabs::draw() {
   calculate_tab_sizes();
   const int tab_draw_y = (tabs_on_bottom_)?Y+H-tab_height_:Y;
 
-  const Fl_Boxtype l_button_box = (pressed_==1)?FL_DOWN_FRAME:FL_UP_FRAME,
-    r_button_box = (pressed_==2)?FL_DOWN_FRAME:FL_UP_FRAME;
+  if (d&(FL_DAMAGE_ALL|DAMAGE_BUTTONS)) {
+    const Fl_Boxtype l_button_box = (pressed_==1)?FL_DOWN_FRAME:FL_UP_FRAME,
+      r_button_box = (pressed_==2)?FL_DOWN_FRAME:FL_UP_FRAME;
   
-  // Draw the left and right buttons.
-  fl_draw_box(l_button_box, X, tab_draw_y, button_width_, tab_height_, color());
-  fl_draw_box(r_button_box, X+W-button_width_, tab_draw_y, button_width_, tab_height_, color());
+    // The buttons are only frames, so clear behind them when the box was not drawn
+    if (!(d&FL_DAMAGE_ALL)) {
+      fl_color(color());
+      fl_rectf(X, tab_draw_y, button_width_, tab_height_);
+      fl_rectf(X+W-button_width_, tab_draw_y, button_width_, tab_height_);
+    }
+    
+    // Draw the left and right buttons.
+    fl_draw_box(l_button_box, X, tab_draw_y, button_width_, tab_height_, color());
+    fl_draw_box(r_button_box, X+W-button_width_, tab_draw_y, button_width_, tab_height_, color());
     
-  {
-    // Draw the arrows    
-    const int l_button_x = X+Fl::box_dx(l_button_box),
-      l_button_y = tab_draw_y+Fl::box_dy(l_button_box),
-      l_button_w = button_width_-Fl::box_dw(l_button_box),
-      l_button_h = tab_height_-Fl::box_dh(l_button_box);
+    {
+      // Draw the arrows    
+      const int l_button_x = X+Fl::box_dx(l_button_box),
+        l_button_y = tab_draw_y+Fl::box_dy(l_button_box),
+        l_button_w = button_width_-Fl::box_dw(l_button_box),
+        l_button_h = tab_height_-Fl::box_dh(l_button_box);
             
-    const int r_button_x = X+W+Fl::box_dx(r_button_box)-button_width_,
-      r_button_y = tab_draw_y+Fl::box_dy(r_button_box),
-      r_button_w = button_width_-Fl::box_dw(r_button_box),
-      r_button_h = tab_height_-Fl::box_dh(r_button_box);
-    
-    fl_color(can_scroll_left()?labelcolor():fl_inactive(labelcolor()));
-    fl_polygon(l_button_x+((l_button_w<<1)/3), l_button_y+(r_button_h/4),
-      l_button_x+(l_button_w/3), l_button_y+(l_button_h>>1),
-      l_button_x+((l_button_w<<1)/3), l_button_y+((l_button_h*3)/4));
+      const int r_button_x = X+W+Fl::box_dx(r_button_box)-button_width_,
+        r_button_y = tab_draw_y+Fl::box_dy(r_button_box),
+        r_button_w = button_width_-Fl::box_dw(r_button_box),
+        r_button_h = tab_height_-Fl::box_dh(r_button_box);
+    
+      fl_color(can_scroll_left()?labelcolor():fl_inactive(labelcolor()));
+      draw_sprite(SPRITE_LEFT, l_button_x, l_button_y, l_button_w, l_button_h);
    
-    fl_color(can_scroll_right()?labelcolor():fl_inactive(labelcolor()));
-    fl_polygon(r_button_x+(r_button_w/3), r_button_y+(r_button_h/4),
-      r_button_x+((r_button_w<<1)/3), r_button_y+(r_button_h>>1),
-      r_button_x+(r_button_w/3), r_button_y+((r_button_h*3)/4));
+      fl_color(can_scroll_right()?labelcolor():fl_inactive(labelcolor()));
+      draw_sprite(SPRITE_RIGHT, r_button_x, r_button_y, r_button_w, r_button_h);
+    }
   }
 
-  {
-    fl_font(labelfont(), labelsize());
+  if (d&(FL_DAMAGE_ALL|DAMAGE_TABS|DAMAGE_HOVER)) {
+    const int view_x = X+button_width_, view_w = w()-(button_width_<<1);
     
     // Clip to the tab bar
-    fl_push_clip(x()+button_width_, tab_draw_y, w()-(button_width_<<1), tab_height_);
-        
-    const int font_offset = ((tab_height_+fl_height())>>1)+(tabs_on_bottom_?-4:0);
+    fl_push_clip(x()+button_width_, tab_draw_y, view_w, tab_height_);
     
-    tab_positions();
+    // Only our box behind the tabs needs to be drawn again
+    if (!(d&FL_DAMAGE_ALL) && !buffer_tabs_)
+      fl_draw_box(box(), x(), y(), w(), h(), color());
     
-    // Draw children.
-    for (int i = 0; i<children(); i++) {
-      // The x of the current tab we want to draw.
-      const int that_x = X+tab_pos[i]-offset+button_width_;
-            
-      if (fl_not_clipped(that_x, tab_draw_y, tab_width[i], tab_height_)==0)
-        continue;
-
-      // Draw the frame for the tab panel
-      if (child(i)==value_)
-        fl_draw_box(FL_DOWN_BOX, that_x-2, tab_draw_y+(tabs_on_bottom_?-4:2), tab_width[i], tab_height_+2+TAB_SELECTION_BORDER, selection_color());
-      else
-        fl_draw_box(FL_UP_BOX, that_x, tab_draw_y+(tabs_on_bottom_?-4:2), tab_width[i]-(TAB_SELECTION_BORDER<<1), tab_height_+2, color());
-                        
-      // Draw the tab title
-      fl_push_clip(that_x, tab_draw_y-TAB_SELECTION_BORDER, tab_width[i]-(closebutton_?button_width_:0), tab_height_);
-      fl_color(labelcolor());
-      fl_draw(tab_labels[i], that_x, tab_draw_y+font_offset);
-      fl_pop_clip();
-
-      if (closebutton_) {
-      
-        int box_offset = ((tab_height_-button_width_)+(button_width_>>1))>>1;
-        
-        // Draw the close button
-        fl_draw_box(FL_THIN_DOWN_FRAME, that_x+tab_width[i]-button_width_-4, tab_draw_y+box_offset+(tabs_on_bottom_?-3:0), button_width_-4, button_width_-4, color());
-        fl_color(labelcolor());
-        // Draw a closed loop as so:
-        /*   v-v <= cross_edge_diff
-                  <
-                  | <= cross_insets
-                  <
-                2
-               / \
-              1   \
-               .   \
-                .   \
-                 .   3
-                  . /
-                   4
-      ...
-                   1
-                  . \
-                 .   2
-                .   /
-               .   /
-              4   /
-               \ /
-                3  
-        */
-        
-        const int box_bound_x = that_x+tab_width[i]-button_width_-5+Fl::box_dx(FL_THIN_DOWN_FRAME),
-          box_bound_y = tab_draw_y+box_offset+(tabs_on_bottom_?-3:1),
-          box_bound_w = button_width_-4-Fl::box_dw(FL_THIN_DOWN_FRAME),
-          box_bound_h = button_width_-4-Fl::box_dh(FL_THIN_DOWN_FRAME),
-          cross_insets = 2, cross_edge_diff = 1;
-
-        // Top left to bottom right
-        fl_polygon(box_bound_x+cross_insets, box_bound_y+cross_insets+cross_edge_diff,
-          box_bound_x+cross_insets+cross_edge_diff, box_bound_y+cross_insets,
-          box_bound_x+box_bound_w-cross_insets, box_bound_y+box_bound_h-cross_insets-cross_edge_diff,
-          box_bound_x+box_bound_w-cross_insets-cross_edge_diff, box_bound_y+box_bound_h-cross_insets);
-        
-        // Top right to bottom left
-        fl_polygon(box_bound_x+box_bound_w-cross_insets-cross_edge_diff, box_bound_y+cross_insets,
-          box_bound_x+box_bound_w-cross_insets, box_bound_y+cross_insets+cross_edge_diff,
-          box_bound_x+cross_insets+cross_edge_diff, box_bound_y+box_bound_h-cross_insets,
-          box_bound_x+cross_insets, box_bound_y+box_bound_h-cross_insets-cross_edge_diff);
-        
-        
-        //fl_polygon();
-      }
-    }
+    if (buffer_tabs_)
+      draw_buffered_tabs(view_x, tab_draw_y, view_w);
+    else
+      draw_tabs(view_x, tab_draw_y, offset, view_w);
 
     fl_pop_clip();
-  }    
+  }
     // Draw the selected child.
-    if (value_)
+    if (value_) {
+      if (d&FL_DAMAGE_ALL)
         draw_child(*value_);
+      else
+        update_child(*value_);
+    }
+}
+
+/*
+  Draw the tabs that lie between offset `from' and `from'+`view_w' in the laid out
+  strip, with that part of the strip starting at `view_x', `tab_draw_y'.
+*/
+void Fl_Scroll_Tabs::draw_tabs(int view_x, int tab_draw_y, long from, int view_w) {
+  fl_font(labelfont(), labelsize());
+  const int font_offset = ((tab_height_+fl_height())>>1)+(tabs_on_bottom_?-4:0);
+  
+  // Only the tabs between from and the far edge of the tab bar can be seen.
+  // The selected tab's frame reaches a little past its left edge, so start one tab earlier.
+  int first_visible = tab_at(from), last_visible = tab_at(from+view_w);
+  if (first_visible<0)
+    first_visible = tab_count;
+  else if (first_visible>0)
+    first_visible--;
+  if (last_visible<0)
+    last_visible = tab_count-1;
+
+  // Draw children.
+  long start = tab_start(first_visible);
+  for (int i = first_visible; i<=last_visible; start += tab_w(i), i++) {
+    // The x of the current tab we want to draw.
+    const int that_x = view_x+start-from;
+          
+    if (fl_not_clipped(that_x, tab_draw_y, tab_w(i), tab_height_)==0)
+      continue;
+
+    draw_tab(i, that_x, tab_draw_y, font_offset);
+  }
+}
+
+void Fl_Scroll_Tabs::draw_tab(int i, int that_x, int tab_draw_y, int font_offset) {
+  // Draw the frame for the tab panel
+  if (model_?(i==value_index_):(tab_kids[i]==value_))
+    fl_draw_box(FL_DOWN_BOX, that_x-2, tab_draw_y+(tabs_on_bottom_?-4:2), tab_w(i), tab_height_+2+TAB_SELECTION_BORDER, selection_color());
+  else
+    fl_draw_box(FL_UP_BOX, that_x, tab_draw_y+(tabs_on_bottom_?-4:2), tab_w(i)-(TAB_SELECTION_BORDER<<1), tab_height_+2, color());
+                    
+  // Draw the tab title
+  fl_push_clip(that_x, tab_draw_y-TAB_SELECTION_BORDER, tab_w(i)-(closebutton_?button_width_:0), tab_height_);
+  fl_color(labelcolor());
+  fl_draw(fixed_w_?fixed_label(i):tab_label(i), that_x, tab_draw_y+font_offset);
+  fl_pop_clip();
+
+  if (closebutton_) {
+  
+    int box_offset = ((tab_height_-button_width_)+(button_width_>>1))>>1;
+    
+    // Draw the close button, raised while the mouse is over it
+    fl_draw_box((hover_close_ && (i==hover_tab_))?FL_THIN_UP_BOX:FL_THIN_DOWN_FRAME, that_x+tab_w(i)-button_width_-4, tab_draw_y+box_offset+(tabs_on_bottom_?-3:0), button_width_-4, button_width_-4, color());
+    fl_color(labelcolor());
+    const int box_bound_x = that_x+tab_w(i)-button_width_-5+Fl::box_dx(FL_THIN_DOWN_FRAME),
+      box_bound_y = tab_draw_y+box_offset+(tabs_on_bottom_?-3:1),
+      box_bound_w = button_width_-4-Fl::box_dw(FL_THIN_DOWN_FRAME),
+      box_bound_h = button_width_-4-Fl::box_dh(FL_THIN_DOWN_FRAME);
+    draw_sprite(SPRITE_CROSS, box_bound_x, box_bound_y, box_bound_w, box_bound_h);
+  }
+}
+
+// Draw the shape of sprite `kind' at `w' by `h', with its top left corner at 0, 0.
+static void sprite_shape(int kind, int w, int h) {
+  switch (kind) {
+    case SPRITE_CROSS:
+      // Draw a closed loop as so:
+      /*   v-v <= cross_edge_diff
+                <
+                | <= cross_insets
+                <
+              2
+             / \
+            1   \
+             .   \
+              .   \
+               .   3
+                . /
+                 4
+    ...
+                 1
+                . \
+               .   2
+              .   /
+             .   /
+            4   /
+             \ /
+              3  
+      */
+      {
+        const int cross_insets = 2, cross_edge_diff = 1;
+        
+        // Top left to bottom right
+        fl_polygon(cross_insets, cross_insets+cross_edge_diff,
+          cross_insets+cross_edge_diff, cross_insets,
+          w-cross_insets, h-cross_insets-cross_edge_diff,
+          w-cross_insets-cross_edge_diff, h-cross_insets);
+        
+        // Top right to bottom left
+        fl_polygon(w-cross_insets-cross_edge_diff, cross_insets,
+          w-cross_insets, cross_insets+cross_edge_diff,
+          cross_insets+cross_edge_diff, h-cross_insets,
+          cross_insets, h-cross_insets-cross_edge_diff);
+      }
+    break;
+    case SPRITE_LEFT:
+      fl_polygon((w<<1)/3, h/4, w/3, h>>1, (w<<1)/3, (h*3)/4);
+    break;
+    case SPRITE_RIGHT:
+      fl_polygon(w/3, h/4, (w<<1)/3, h>>1, w/3, (h*3)/4);
+    break;
+  }
+}
+
+/*
+  Draw sprite `kind' filling `W' by `H' at `X', `Y' in the current color.
+  It is drawn again, by rasterizing the same polygons offscreen and reading the
+  pixels back, only when its size changes, such as after tab_height() does.
+*/
+void Fl_Scroll_Tabs::draw_sprite(int kind, int X, int Y, int W, int H) {
+  if ((W<=0) || (H<=0))
+    return;
+  
+  Fl_Scroll_Tabs_Sprite *const sprite = sprites_+kind;
+  if (!sprite->bitmap || (sprite->w!=W) || (sprite->h!=H)) {
+    delete sprite->bitmap;
+    free(sprite->bits);
+    
+    const Fl_Color color = fl_color();
+    const Fl_Offscreen offscreen = fl_create_offscreen(W, H);
+    fl_begin_offscreen(offscreen);
+    fl_color(FL_WHITE);
+    fl_rectf(0, 0, W, H);
+    fl_color(FL_BLACK);
+    sprite_shape(kind, W, H);
+    uchar *const rgb = fl_read_image(NULL, 0, 0, W, H);
+    fl_end_offscreen();
+    fl_delete_offscreen(offscreen);
+    fl_color(color);
+    
+    // XBM rows are whole bytes, with the leftmost pixel in the lowest bit
+    const int row = (W+7)>>3;
+    sprite->bits = (uchar *)calloc(row*H, 1);
+    for (int y = 0; rgb && (y<H); y++) {
+      for (int x = 0; x<W; x++) {
+        if (rgb[(y*W+x)*3]<128)
+          sprite->bits[y*row+(x>>3)] |= 1<<(x&7);
+      }
+    }
+    delete[] rgb;
+    
+    sprite->bitmap = new Fl_Bitmap(sprite->bits, W, H);
+    sprite->w = W;
+    sprite->h = H;
+  }
+  sprite->bitmap->draw(X, Y);
+}
+
+void Fl_Scroll_Tabs::draw_buffered_tabs(int view_x, int tab_draw_y, int view_w) {
+  Fl_Scroll_Tabs_Strip *const strip = strip_;
+  const int strip_w = view_w*BUFFERED_VIEWS;
+  
+  if (strip->offscreen && ((strip->w!=strip_w) || (strip->h!=tab_height_))) {
+    fl_delete_offscreen(strip->offscreen);
+    strip->offscreen = 0;
+  }
+  
+  if (!strip->offscreen ||
+      ((long)offset<strip->from) || ((long)offset+view_w>strip->from+strip->w) ||
+      (strip->layout_serial!=layout_serial_) || (strip->value!=value_) ||
+      (strip->color!=color()) || (strip->selection_color!=selection_color()) || (strip->labelcolor!=labelcolor()) ||
+      (strip->labelfont!=labelfont()) || (strip->labelsize!=labelsize()) ||
+      (strip->closebutton!=closebutton_) || (strip->tabs_on_bottom!=tabs_on_bottom_) ||
+      (strip->hover_tab!=hover_tab_) || (strip->hover_close!=hover_close_)) {
+    
+    if (!strip->offscreen) {
+      strip->offscreen = fl_create_offscreen(strip_w, tab_height_);
+      strip->w = strip_w;
+      strip->h = tab_height_;
+    }
+    
+    // Center the buffer on the view, so that scrolling either way stays inside it for a while.
+    strip->from = ((long)offset>view_w)?(long)offset-view_w:0;
+    strip->layout_serial = layout_serial_;
+    strip->value = value_;
+    strip->color = color();
+    strip->selection_color = selection_color();
+    strip->labelcolor = labelcolor();
+    strip->labelfont = labelfont();
+    strip->labelsize = labelsize();
+    strip->closebutton = closebutton_;
+    strip->tabs_on_bottom = tabs_on_bottom_;
+    strip->hover_tab = hover_tab_;
+    strip->hover_close = hover_close_;
+    
+    fl_begin_offscreen(strip->offscreen);
+    fl_color(color());
+    fl_rectf(0, 0, strip->w, strip->h);
+    draw_tabs(0, 0, strip->from, strip->w);
+    fl_end_offscreen();
+  }
+  
+  fl_copy_offscreen(view_x, tab_draw_y, view_w, tab_height_, strip->offscreen, offset-strip->from, 0);
+}
+
+/**
+  Sets whether the tab bar is drawn through an offscreen buffer.
+  The tabs around the visible part of the tab bar are drawn once into the buffer,
+  and scrolling only copies a different part of it to the screen. The buffer is
+  drawn again when the tabs, selection, colors or label font change, or when
+  scrolling leaves it.
+  The tabs in the buffer are drawn on a plain background of color() rather than box().
+*/
+void Fl_Scroll_Tabs::buffer_tabs(int b) {
+  buffer_tabs_ = (b!=0);
+  if (!buffer_tabs_ && strip_->offscreen) {
+    fl_delete_offscreen(strip_->offscreen);
+    strip_->offscreen = 0;
+  }
+  redraw();
 }
 
 /**
@@ -394,115 +1531,332 @@ void Fl_Scroll_Tabs::draw() {
            0 if there are no children or if the event is outside of the tabs area.
 */
 Fl_Widget *Fl_Scroll_Tabs::which(int event_x, int event_y) {
+  const int i = which_tab(event_x, event_y);
+  if (model_)
+    return ((i>=0) && (i==value_index_))?value_:NULL;
+  return (i<0)?NULL:child(i);
+}
+
+int Fl_Scroll_Tabs::which_tab(int event_x, int event_y) {
   if ((event_y<y()) || 
     (event_x<x()+button_width_) || (event_x>x()+w()-button_width_))
-    return NULL;
+    return -1;
   
   if (!tabs_on_bottom_ && (event_y>y()+tab_height_))
-    return NULL;
+    return -1;
   if (tabs_on_bottom_ && (event_y<y()+h()-tab_height_))
-    return NULL;
+    return -1;
   
   tab_positions();
   
-  const int effective_x = event_x+offset-button_width_;
+  // During an update the layout may still have tabs that were removed
+  const int i = tab_at(event_x+offset-button_width_);
+  return (i<tabs())?i:-1;
+}
+
+/*
+  Descends the Fenwick tree of the tab widths. Tabs include both of their edges, so
+  on a shared edge the left tab wins, the same as a front-to-back scan would.
+*/
+int Fl_Scroll_Tabs::tab_at(long x) const {
+  if ((tab_count==0) || (x<0))
+    return -1;
+  
+  if (fixed_w_) {
+    const long first = (x>0)?(x-1)/fixed_w_:0;
+    return (first>=tab_count)?-1:(int)first;
+  }
   
-  for (int i = 0; i<tab_count; i++){
-      if(effective_x>=tab_pos[i] && effective_x<=tab_pos[i]+tab_width[i])
-          return child(i);
+  // Find the first tab whose right edge is at or past x: skip over every
+  // part of the tree whose tabs all end before x.
+  int step = 1;
+  while ((step<<1)<=tab_count)
+    step <<= 1;
+  int first = 0;
+  for (; step; step >>= 1) {
+    if ((first+step<=tab_count) && (tab_tree[first+step-1]<x)) {
+      first += step;
+      x -= tab_tree[first-1];
+    }
   }
-  return NULL;
-
+  
+  return (first==tab_count)?-1:first;
 }
 
 int Fl_Scroll_Tabs::calculate_tab_sizes() {
-  if (!children()) return 1;
+  if (!tabs()) return 1;
 
-  tab_positions();
+  tab_bar_size();
 
-  tab_height_ = tab_height();
-  if(tab_height_<0){
-    tab_height_ = -tab_height_;
-    tabs_on_bottom_ = 1;
+  // After button_width_, since the tab padding depends on it.
+  tab_positions();
+  
+  // Children that were added or moved may have changed the tab height
+  if (tab_height_h_<0) {
+    tab_bar_size();
+    tab_positions();
   }
-  else
-    tabs_on_bottom_ = 0;
-
-  button_width_ = tab_height_;
-  if(button_width_ > MAXIMUM_BUTTON_WIDTH) button_width_ = MAXIMUM_BUTTON_WIDTH;
 
   return 0;
 }
 
+void Fl_Scroll_Tabs::tab_bar_size() {
+  // The tab height only changes when the children or our height do
+  if (!layout_valid_ || model_changed_ || (tab_height_h_!=h()) || (tab_height_children_!=children())) {
+    tab_height_ = tab_height();
+    if(tab_height_<0){
+      tab_height_ = -tab_height_;
+      tabs_on_bottom_ = 1;
+    }
+    else
+      tabs_on_bottom_ = 0;
+
+    button_width_ = tab_height_;
+    if(button_width_ > MAXIMUM_BUTTON_WIDTH) button_width_ = MAXIMUM_BUTTON_WIDTH;
+    
+    tab_height_h_ = h();
+    tab_height_children_ = children();
+  }
+}
+
 int Fl_Scroll_Tabs::can_scroll_left() const {
   return offset>0;
 }
 
 int Fl_Scroll_Tabs::can_scroll_right() const {
-  const long final_position =  tab_pos[tab_count-1]+tab_width[tab_count-1];
+  if (tab_count==0)
+    return 0;
+  
+  const long final_position = tab_start(tab_count);
   
   if(final_position<w())
     return 0;
   
-  const long max_offset = final_position-w()+(button_width_<<1);
-  return (max_offset>0) && (offset<max_offset);
+  // There is more to see if some tab lies past the far edge of the view.
+  return tab_at(offset+w()-(button_width_<<1)+1)>=0;
 }
 
 void Fl_Scroll_Tabs::increment_cb() {
   if (can_scroll_left()) {
     offset--;
-    redraw();
+    redraw_tabs();
   }
 }
 
 void Fl_Scroll_Tabs::decrement_cb() {
   if (can_scroll_right()) {
     offset++;
-    redraw();
+    redraw_tabs();
   }
 }
 
 void Fl_Scroll_Tabs::timeout_cb(void *a) {
-  Fl_Scroll_Tabs *that = static_cast<Fl_Scroll_Tabs *>(a);
+  static_cast<Fl_Scroll_Tabs *>(a)->scroll_frame();
+}
+
+long Fl_Scroll_Tabs::max_offset() const {
+  if (tab_count==0)
+    return 0;
+  const long m = tab_start(tab_count)-w()+(button_width_<<1);
+  return (m>0)?m:0;
+}
+
+/*
+  Start calling scroll_frame() every frame after `delay', if it isn't being called already.
+*/
+void Fl_Scroll_Tabs::start_scrolling(double delay) {
+  if (scrolling_)
+    return;
+  scrolling_ = 1;
+  scroll_time_ = 0.0;
+  scroll_pos_ = offset;
+  Fl::add_timeout(delay, timeout_cb, this);
+}
 
-  for (int i = 0; i<TAB_SCROLL; i++)
-    that->do_scroll_cb();
+/*
+  Move offset by however far the held button, wheel inertia or make_tab_visible()
+  slide should have moved it since the last frame, and damage the tab bar at most once.
+*/
+void Fl_Scroll_Tabs::scroll_frame() {
+  const double now = scroll_clock();
+  double dt = (scroll_time_==0.0)?SCROLL_FRAME:now-scroll_time_;
+  if (dt>MAXIMUM_FRAME_TIME)
+    dt = MAXIMUM_FRAME_TIME;
+  scroll_time_ = now;
+  
+  // Something else moved the tabs since the last frame
+  if (fabs(scroll_pos_-offset)>=1.0)
+    scroll_pos_ = offset;
+  
+  const long limit = max_offset();
+  int moving = 1;
+  if (pressed_==1)
+    scroll_pos_-=BUTTON_SCROLL_SPEED*dt;
+  else if (pressed_==2)
+    scroll_pos_+=BUTTON_SCROLL_SPEED*dt;
+  else if (scroll_target_>=0.0) {
+    // The tabs may have shrunk since the slide started, and it could never get past the end
+    if (scroll_target_>limit)
+      scroll_target_ = limit;
+    scroll_pos_+=(scroll_target_-scroll_pos_)*(1.0-exp(-SLIDE_RATE*dt));
+    if (fabs(scroll_target_-scroll_pos_)<0.5) {
+      scroll_pos_ = scroll_target_;
+      scroll_target_ = -1.0;
+      moving = 0;
+    }
+  }
+  else if (scroll_velocity_!=0.0) {
+    scroll_pos_+=scroll_velocity_*dt;
+    scroll_velocity_*=exp(-WHEEL_FRICTION*dt);
+    if (fabs(scroll_velocity_)<MINIMUM_SCROLL_SPEED)
+      scroll_velocity_ = 0.0;
+  }
+  else
+    moving = 0;
+  
+  if (scroll_pos_<0.0) {
+    scroll_pos_ = 0.0;
+    scroll_velocity_ = 0.0;
+  }
+  else if (scroll_pos_>limit) {
+    scroll_pos_ = limit;
+    scroll_velocity_ = 0.0;
+  }
+  
+  const unsigned long new_offset = (unsigned long)(scroll_pos_+0.5);
+  if (new_offset!=offset) {
+    offset = new_offset;
+    STAT(scroll_redraws);
+    redraw_tabs();
+  }
+  
+  if (moving || (scroll_velocity_!=0.0))
+    Fl::repeat_timeout(SCROLL_FRAME, timeout_cb, this);
+  else
+    scrolling_ = 0;
+}
 
-  Fl::add_timeout(REPEAT, timeout_cb, that);
+void Fl_Scroll_Tabs::wheel_scroll(int notches) {
+  tab_positions();
+  scroll_target_ = -1.0;
+  
+  if (!smooth_scroll_) {
+    long o = (long)offset+notches*WHEEL_STEP;
+    if (o>max_offset())
+      o = max_offset();
+    if (o<0)
+      o = 0;
+    if ((unsigned long)o!=offset) {
+      offset = o;
+      redraw_tabs();
+    }
+    return;
+  }
+  
+  // Turning the wheel the other way stops the tabs first
+  if ((scroll_velocity_<0.0)!=(notches<0))
+    scroll_velocity_ = 0.0;
+  scroll_velocity_+=notches*WHEEL_IMPULSE;
+  if (scroll_velocity_>MAXIMUM_WHEEL_SPEED)
+    scroll_velocity_ = MAXIMUM_WHEEL_SPEED;
+  else if (scroll_velocity_<-MAXIMUM_WHEEL_SPEED)
+    scroll_velocity_ = -MAXIMUM_WHEEL_SPEED;
+  start_scrolling(0.0);
 }
 
 int Fl_Scroll_Tabs::ensure_value() {
-  int w = children();
+  if (model_)
+    return ensure_model_value();
+  
+  const int n = children();
     
-  if (w==0) {
+  if (n==0) {
     value_ = NULL;
+    value_index_ = -1;
+    value_children_ = 0;
+    return 0;
+  }
+  
+  // end_update() will sort the selection out
+  if (update_depth_ && value_)
+    return value_index_;
+  
+  // Nothing was added or removed since the selection was made, and the selected
+  // child is still where it was. Children are usually added at the end, so make
+  // sure the last one is hidden too.
+  if (value_ && (value_children_==n) && (value_index_<n) && (child(value_index_)==value_) &&
+      ((value_index_==n-1) || !child(n-1)->visible())) {
+#ifdef FL_SCROLL_TABS_DEBUG
+    check_value();
+#endif
+    return value_index_;
+  }
+  
+  int w = 0;
+  if (value_!=NULL) {
+    STAT(value_scans);
+    w = find(value_);
+    if (w==n)
+      w = n-1;
+  }
+  
+  // The children changed, so any of them might be showing.
+  value_children_ = -1;
+  select(w);
+  return w;
+}
+
+/*
+  Make child `i' the selected one, hiding the one that was selected. If the
+  children were changed since the last selection, every other child is hidden.
+*/
+void Fl_Scroll_Tabs::select(int i) {
+  if (model_) {
+    select_model(i);
+    return;
   }
-  else if (value_==NULL) {
-    value_ = child(0);
-    w = 0;
+  
+  const int n = children();
+  Fl_Widget *const kid = child(i);
+  
+  if ((value_children_==n) && (value_index_>=0) && (value_index_<n) && (child(value_index_)==value_)) {
+    if (value_!=kid)
+      value_->hide();
   }
   else {
-    const int n = w;
-    int i = 0;
-    for(Fl_Widget *const *childs=array(); i < n; childs++, i++){
-      if(*childs==value_)
-        w = i;
-      else
+    int j = 0;
+    for(Fl_Widget *const *childs=array(); j < n; childs++, j++){
+      if(j!=i)
         (*childs)->hide();
     }
-        
-    if(w==children())
-      value_=child(w-1);
-        
-    if(!value_->visible())
-      value_->show(); 
   }
-  return w;
+  
+  value_ = kid;
+  value_index_ = i;
+  value_children_ = n;
+  
+  if (kid->type()==FL_SCROLL_TABS_LAZY)
+    lazy_selected((Fl_Scroll_Tabs_Lazy *)kid);
+  
+  if(!value_->visible())
+    value_->show(); 
+}
+
+#ifdef FL_SCROLL_TABS_DEBUG
+#include <assert.h>
+// Make sure the cached selection agrees with the children
+void Fl_Scroll_Tabs::check_value() const {
+  assert(value_index_>=0 && value_index_<children());
+  assert(child(value_index_)==value_);
+  for (int i = 0; i<children(); i++)
+    assert((i==value_index_)?child(i)->visible():!child(i)->visible());
 }
+#endif
 
 // Stolen from Fl_Tabs
 int Fl_Scroll_Tabs::tab_height() {
-  if (children() == 0) return h();
+  // A model's tabs may not have made their content yet
+  if (children() == 0) return model_?(tabs_on_bottom_?-tab_height_:tab_height_):h();
   int H = h();
   int H2 = y();
   Fl_Widget*const* a = array();
@@ -517,14 +1871,2154 @@ int Fl_Scroll_Tabs::tab_height() {
 }
 
 void Fl_Scroll_Tabs::make_tab_visible(int i) {
-  tab_positions();
+  if (update_depth_) {
+    if (model_)
+      update_visible_index_ = i;
+    else if ((i>=0) && (i<children()))
+      update_visible_ = child(i);
+    return;
+  }
   
+  tab_positions();
   
+  if ((i<0) || (i>=tab_count))
+    return;
+
   const int view_width = w()-Fl::box_dw(box())-(button_width_<<1),
     end_visible_x = offset+view_width;
+  long new_offset = offset;
     
-  if(tab_pos[i]<offset) offset = tab_pos[i];
-  if(tab_pos[i]+tab_width[i]>end_visible_x) offset = tab_pos[i]-view_width+tab_width[i];
+  const long start = tab_start(i);
+  if(start<(long)offset) new_offset = start;
+  if(start+tab_w(i)>end_visible_x) new_offset = start-view_width+tab_w(i);
+  // Never past either end, which a slide could not reach
+  if (new_offset>max_offset()) new_offset = max_offset();
+  if (new_offset<0) new_offset = 0;
+  
+  if (smooth_scroll_ && window() && visible_r()) {
+    // Slide there, unless nothing needs to move
+    if (new_offset!=(long)offset) {
+      scroll_target_ = new_offset;
+      scroll_velocity_ = 0.0;
+      start_scrolling(0.0);
+    }
+  }
+  else if (new_offset!=(long)offset) {
+    scroll_target_ = -1.0;
+    offset = new_offset;
+    redraw_tabs();
+  }
+}
+
+int Fl_Scroll_Tabs::tab_bar_y() const {
+  return (tabs_on_bottom_)?y()+h()-Fl::box_dh(box())+Fl::box_dy(box())-tab_height_:y()+Fl::box_dy(box());
+}
+
+/*
+  Damage the whole tab bar, including the scroll buttons, but not the selected tab's group.
+*/
+void Fl_Scroll_Tabs::redraw_tabs() {
+  if (update_depth_)
+    return;
+  damage(DAMAGE_TABS|DAMAGE_BUTTONS, x(), tab_bar_y(), w(), tab_height_);
+}
+
+void Fl_Scroll_Tabs::redraw_buttons() {
+  if (update_depth_)
+    return;
+  const int Y = tab_bar_y();
+  damage(DAMAGE_BUTTONS, x(), Y, button_width_+Fl::box_dx(box()), tab_height_);
+  damage(DAMAGE_BUTTONS, x()+w()-button_width_-Fl::box_dx(box()), Y, button_width_+Fl::box_dx(box()), tab_height_);
+}
+
+/*
+  Damage only the rectangle of tab `i', with `bits', if any of it is in view.
+*/
+void Fl_Scroll_Tabs::redraw_tab(int i, unsigned char bits) {
+  if (update_depth_ || (i<0) || (i>=tab_count))
+    return;
+  
+  const int view_x = x()+Fl::box_dx(box())+button_width_, view_w = w()-(button_width_<<1);
+  // The selected tab's frame reaches a little past its left edge.
+  long tab_x = view_x+tab_start(i)-(long)offset-TAB_SELECTION_BORDER, tab_r = tab_x+tab_w(i)+TAB_SELECTION_BORDER;
+  if (tab_x<view_x)
+    tab_x = view_x;
+  if (tab_r>view_x+view_w)
+    tab_r = view_x+view_w;
+  if (tab_r>tab_x)
+    damage(bits, tab_x, tab_bar_y(), tab_r-tab_x, tab_height_);
+}
+
+int Fl_Scroll_Tabs::over_close_button(int i, int event_x) const {
+  if (!closebutton_)
+    return 0;
+  const long hotspot_x = tab_start(i+1), effective_x = event_x+(long)offset-button_width_;
+  return (effective_x>=hotspot_x-button_width_) && (effective_x<=hotspot_x);
+}
+
+/*
+  Track the tab the mouse is over, and whether it is over that tab's close button.
+  Only the tabs whose look changes are redrawn.
+*/
+void Fl_Scroll_Tabs::hover(int i, int close) {
+  close = close && (i>=0);
+  if ((i==hover_tab_) && (close==hover_close_))
+    return;
+  
+  // Only the close button looks different while hovered
+  if (hover_close_ || close) {
+    redraw_tab(hover_tab_, DAMAGE_HOVER);
+    if (i!=hover_tab_)
+      redraw_tab(i, DAMAGE_HOVER);
+  }
+  hover_tab_ = i;
+  hover_close_ = close;
+}
+
+/**
+  Adds a tab whose content is only built when it is first selected.
+  The tab is an empty group labelled \p label until then. When it is selected,
+  \p load is called with the group current to create the content.
+  If a budget is set with lazy_budget(), tabs that have not been selected for
+  the longest are unloaded to stay within it: \p unload is called to tear the
+  content down, or if it is NULL all of the group's children are deleted.
+  \p label is copied.
+*/
+Fl_Scroll_Tabs_Lazy *Fl_Scroll_Tabs::add_lazy(const char *label, Fl_Scroll_Tabs_Load_Cb load, Fl_Scroll_Tabs_Unload_Cb unload, void *arg) {
+  Fl_Group *const current = Fl_Group::current();
+  Fl_Group::current(NULL);
+  
+  // Take the same place as the other tabs, or the space beside the tab bar if this is the first.
+  Fl_Scroll_Tabs_Lazy *page;
+  if (children())
+    page = new Fl_Scroll_Tabs_Lazy(child(0)->x(), child(0)->y(), child(0)->w(), child(0)->h(), NULL, load, unload, arg);
+  else
+    page = new Fl_Scroll_Tabs_Lazy(x(), tabs_on_bottom_?y():y()+tab_height_, w(), h()-tab_height_, NULL, load, unload, arg);
+  page->copy_label(label);
+  page->hide();
+  add(page);
+  
+  Fl_Group::current(current);
+  return page;
+}
+
+/*
+  Load a tab that was just selected if it needs it, and mark it most recently used.
+  A lazy tab's owner_ is set only while it is in our list of loaded tabs.
+*/
+void Fl_Scroll_Tabs::lazy_selected(Fl_Scroll_Tabs_Lazy *page) {
+  if (page->owner_)
+    page->owner_->lazy_unlink(page);
+  if (!page->loaded_)
+    page->load();
+  
+  page->lru_prev_ = NULL;
+  page->lru_next_ = lazy_first_;
+  if (lazy_first_)
+    lazy_first_->lru_prev_ = page;
+  else
+    lazy_last_ = page;
+  lazy_first_ = page;
+  lazy_loaded_++;
+  lazy_bytes_+=page->bytes_;
+  page->owner_ = this;
+  
+  lazy_trim();
+}
+
+void Fl_Scroll_Tabs::lazy_unlink(Fl_Scroll_Tabs_Lazy *page) {
+  page->owner_ = NULL;
+  if ((page->lru_prev_==NULL) && (lazy_first_!=page))
+    return; // not in the list
+  
+  if (page->lru_prev_)
+    page->lru_prev_->lru_next_ = page->lru_next_;
+  else
+    lazy_first_ = page->lru_next_;
+  if (page->lru_next_)
+    page->lru_next_->lru_prev_ = page->lru_prev_;
+  else
+    lazy_last_ = page->lru_prev_;
+  page->lru_prev_ = page->lru_next_ = NULL;
+  
+  lazy_loaded_--;
+  lazy_bytes_-=page->bytes_;
+}
+
+// A tab was taken out of us. If it is a loaded lazy tab, it no longer counts against lazy_budget().
+void Fl_Scroll_Tabs::lazy_removed(Fl_Widget *w) {
+  if ((w->type()==FL_SCROLL_TABS_LAZY) && (((Fl_Scroll_Tabs_Lazy *)w)->owner_==this))
+    lazy_unlink((Fl_Scroll_Tabs_Lazy *)w);
+}
+
+// Unload the least recently selected tabs until the budget is met. The selected tab is never unloaded.
+void Fl_Scroll_Tabs::lazy_trim() {
+  while (lazy_last_ && (lazy_last_!=value_) &&
+         (((lazy_max_loaded_>0) && (lazy_loaded_>lazy_max_loaded_)) ||
+          ((lazy_max_bytes_>0) && (lazy_bytes_>lazy_max_bytes_)))) {
+    Fl_Scroll_Tabs_Lazy *const page = lazy_last_;
+    // Tabs that were taken out of us keep their content, they just no longer count
+    if (page->parent()!=this)
+      lazy_unlink(page);
+    else
+      page->unload();
+  }
+}
+
+Fl_Scroll_Tabs_Lazy::Fl_Scroll_Tabs_Lazy(int X, int Y, int W, int H, const char *l, Fl_Scroll_Tabs_Load_Cb load, Fl_Scroll_Tabs_Unload_Cb unload, void *arg)
+  : Fl_Group(X, Y, W, H, l)
+  , load_(load)
+  , unload_(unload)
+  , arg_(arg)
+  , loaded_(0)
+  , bytes_(0)
+  , owner_(NULL)
+  , lru_prev_(NULL)
+  , lru_next_(NULL)
+  , queue_(NULL)
+  , queue_key_(NULL) {
+  type(FL_SCROLL_TABS_LAZY);
+  end();
+}
+
+Fl_Scroll_Tabs_Lazy::~Fl_Scroll_Tabs_Lazy() {
+  if (owner_)
+    owner_->lazy_unlink(this);
+  if (queue_)
+    queue_->forget(this);
+}
+
+/**
+  Builds the content of the tab now, if it isn't already.
+*/
+void Fl_Scroll_Tabs_Lazy::load() {
+  if (loaded_)
+    return;
+  
+  Fl_Group *const current = Fl_Group::current();
+  begin();
+  bytes_ = load_?load_(this, arg_):0;
+  end();
+  Fl_Group::current(current);
+  loaded_ = 1;
+}
+
+/**
+  Tears down the content of the tab, if it is built. It will be built again when the tab is next selected.
+*/
+void Fl_Scroll_Tabs_Lazy::unload() {
+  if (!loaded_)
+    return;
+  
+  if (owner_)
+    owner_->lazy_unlink(this);
+  
+  if (unload_)
+    unload_(this, arg_);
+  else
+    clear();
+  loaded_ = 0;
+  bytes_ = 0;
+  redraw();
+}
+
+/**
+  Starts a batch of changes to the tabs. Until the matching end_update(),
+  the tabs are not laid out, push() and make_tab_visible() are only
+  remembered, and nothing is redrawn. Updates may be nested; only the
+  outermost end_update() does the work.
+  \see Fl_Scroll_Tabs_Update
+*/
+void Fl_Scroll_Tabs::begin_update() {
+  update_depth_++;
+}
+
+/**
+  Ends a batch of changes started with begin_update(). When the outermost
+  update ends, the tabs are laid out once, the last tab passed to push()
+  during the update is selected, and the widget is redrawn.
+*/
+void Fl_Scroll_Tabs::end_update() {
+  if ((update_depth_==0) || (--update_depth_!=0))
+    return;
+  
+  ensure_value();
+  tab_positions();
   
+  if (model_) {
+    const int pushed = update_index_, visible = update_visible_index_;
+    update_index_ = update_visible_index_ = -1;
+    if (pushed>=0)
+      push(pushed);
+    if ((visible>=0) && (visible!=pushed))
+      make_tab_visible(visible);
+    redraw();
+    return;
+  }
+  
+  // The tabs remembered may have been removed since
+  Fl_Widget *const pushed = update_value_, *const visible = update_visible_;
+  update_value_ = update_visible_ = NULL;
+  if (pushed && (find(pushed)!=children()))
+    push(pushed);
+  if (visible && (visible!=pushed)) {
+    const int i = find(visible);
+    if (i!=children())
+      make_tab_visible(i);
+  }
+  
+  redraw();
+}
+
+/**
+  Makes room for \p n tabs in the layout, so that adding that many doesn't reallocate it.
+*/
+void Fl_Scroll_Tabs::reserve_tabs(int n) {
+  reserve_tab_arrays(n);
+}
+
+/**
+  Returns the bytes of memory the widget has allocated for its tabs:
+  the layout, the labels drawn in them and the space used to measure them.
+  The offscreen image of the tabs and the glyph cache shared by all
+  widgets are not counted.
+  \see buffer_tabs(int), glyph_cache_stats()
+*/
+unsigned long Fl_Scroll_Tabs::memory_usage() const {
+  unsigned long m = sizeof(*this)+sizeof(Fl_Scroll_Tabs_Strip)+SPRITE_COUNT*sizeof(Fl_Scroll_Tabs_Sprite)+
+         (unsigned long)tab_capacity_*TAB_ARENA_STRIDE+label_pool_size_+
+         (unsigned long)truncate_capacity_*(sizeof(int)+sizeof(double));
+  if (find_)
+    m += sizeof(Fl_Scroll_Tabs_Find)+(unsigned long)find_->capacity*3*sizeof(int)+find_->pool_size;
+  return m;
+}
+
+/**
+  Makes the tabs come from \p m instead of the children. Only the selected
+  tab's content exists, as the widget's only child: it is made with
+  Fl_Scroll_Tabs_Model::materialize() when the tab is selected, and handed
+  back with Fl_Scroll_Tabs_Model::release() when another tab is.
+  Labels are drawn in labelfont() and labelsize().
+
+  The model is not watched for changes. Call tabs_changed() after changing it.
+  The widget should have no other children while a model is set. Passing NULL
+  releases the content and goes back to using the children as tabs.
+*/
+void Fl_Scroll_Tabs::model(Fl_Scroll_Tabs_Model *m) {
+  if (model_ && value_) {
+    Fl_Widget *const content = value_;
+    remove(content);
+    model_->release(value_index_, content);
+  }
+  
+  model_ = m;
+  value_ = NULL;
+  value_index_ = -1;
+  value_materialized_ = 0;
+  value_children_ = 0;
+  offset = 0;
+  invalidate_layout();
+  redraw();
+}
+
+/**
+  Tells the widget that the tabs of its model changed, or that the text of
+  labels or the positions of its children were changed in place, so every tab
+  is looked at again the next time they are needed. The selected tab's content
+  is kept unless the selected tab no longer exists.
+
+  Children that are added, removed or moved, and children given another label,
+  font or size, are found without this.
+  \see tab_changed()
+*/
+void Fl_Scroll_Tabs::tabs_changed() {
+  model_changed_ = 1;
+  if (model_ && (value_index_>=model_->count()))
+    ensure_value();
   redraw();
 }
+
+int Fl_Scroll_Tabs::ensure_model_value() {
+  const int n = model_->count();
+  if (n==0) {
+    select_model(-1);
+    return 0;
+  }
+  
+  if ((value_index_>=0) && (value_index_<n) && value_materialized_)
+    return value_index_;
+  
+  select_model((value_index_<0)?0:((value_index_>=n)?n-1:value_index_));
+  return value_index_;
+}
+
+/*
+  Replace the content with that of tab `i', or with nothing if `i' is negative.
+*/
+void Fl_Scroll_Tabs::select_model(int i) {
+  // A tab whose content is NULL is only materialized once
+  if ((i==value_index_) && (value_materialized_ || (i<0)))
+    return;
+  
+  // The new content takes the place of the old, or the space beside the tab bar
+  int X = x(), Y = tabs_on_bottom_?y():y()+tab_height_, W = w(), H = h()-tab_height_;
+  if (value_) {
+    Fl_Widget *const content = value_;
+    X = content->x();
+    Y = content->y();
+    W = content->w();
+    H = content->h();
+    value_ = NULL;
+    remove(content);
+    model_->release(value_index_, content);
+  }
+  
+  value_index_ = i;
+  value_materialized_ = 0;
+  if (i<0)
+    return;
+  
+  Fl_Group *const current = Fl_Group::current();
+  Fl_Group::current(NULL);
+  value_ = model_->materialize(i, X, Y, W, H);
+  Fl_Group::current(current);
+  value_materialized_ = 1;
+  
+  if (value_) {
+    add(value_);
+    value_->show();
+    value_->redraw();
+  }
+}
+
+/*
+  The model closed tab `i'. Keep the same tab selected if it still exists,
+  or select the one that took the closed tab's place.
+*/
+void Fl_Scroll_Tabs::model_closed(int i) {
+  if (i<value_index_)
+    value_index_--;
+  else if (i==value_index_) {
+    const int n = model_->count();
+    select_model(-1);
+    if (n)
+      select_model((i<n)?i:n-1);
+  }
+  tabs_changed();
+}
+
+/**
+  Tells the widget that the label, font or size of tab \p i changed, so that
+  only that tab is measured again and the tabs after it moved along, in O(log n).
+  This is much cheaper than tabs_changed(). A child given another label, font or
+  size is found without either, by comparing its label pointer. One whose label
+  text is changed in place, or set with copy_label() to a copy that happens to
+  get the old one's address, needs one of them.
+  \see tabs_changed()
+*/
+void Fl_Scroll_Tabs::tab_changed(int i) {
+  // Fixed width tabs have no tree, and only the tab's label is copied again
+  if (layout_valid_ && !update_depth_ && (i>=0) && (i<tab_count) && (tab_count==tabs()) &&
+      (fixed_w_ || (tree_count_==tab_count)) && (model_ || (tab_kids[i]==child(i)))) {
+    if (find_)
+      find_->changes = 0;
+    measure_tab(i, 1, 0);
+    layout_serial_++;
+    compact_labels();
+    redraw_tabs();
+  }
+  else {
+    // Leave it to the next layout
+    model_changed_ = 1;
+    redraw();
+  }
+}
+
+// Move a[from] to a[to], moving the entries between them over by one
+template <class T> static void rotate_entries(T *a, int from, int to) {
+  const T t = a[from];
+  if (from<to)
+    memmove(a+from, a+from+1, (to-from)*sizeof(T));
+  else
+    memmove(a+to+1, a+to, (from-to)*sizeof(T));
+  a[to] = t;
+}
+
+/*
+  Move tab `from' to `to', in the children and in the layout, which must be
+  up to date. Only the tabs between them change, each in O(log n).
+*/
+void Fl_Scroll_Tabs::rotate_tabs(int from, int to) {
+  // Fl_Group moves a child it already has, in one pass over the children
+  insert(*child(from), (to>from)?to+1:to);
+  
+  // The tabs past either end keep their offsets, so only the widths in between change
+  const int step = (from<to)?1:-1, moved = tab_width[from];
+  for (int i = from; i!=to; i += step) {
+    tree_add(i, tab_width[i+step]-tab_width[i]);
+    tab_width[i] = tab_width[i+step];
+  }
+  tree_add(to, moved-tab_width[to]);
+  tab_width[to] = moved;
+  
+  rotate_entries(tab_kids, from, to);
+  rotate_entries(tab_label_ptrs, from, to);
+  rotate_entries(tab_label_offsets, from, to);
+  rotate_entries(tab_label_hashes, from, to);
+  rotate_entries(tab_fonts, from, to);
+  rotate_entries(tab_sizes, from, to);
+  rotate_entries(tab_estimated, from, to);
+  for (int i = from; i!=to+step; i += step)
+    find_changed(i, tab_label_ptrs[i]);
+  
+  if (value_index_==from)
+    value_index_ = to;
+  else if ((from<to) && (value_index_>from) && (value_index_<=to))
+    value_index_--;
+  else if ((from>to) && (value_index_>=to) && (value_index_<from))
+    value_index_++;
+}
+
+/**
+  Moves tab \p from to index \p to, moving the tabs between them over by one,
+  both in the tab bar and in the children. The child is moved once, and only
+  the tabs that moved are updated in the layout, each in O(log n). Tabs that come from a model() can't be moved.
+  Returns \p to, or -1 if either index is out of range.
+  \see reorderable(int)
+*/
+int Fl_Scroll_Tabs::move_tab(int from, int to) {
+  const int n = children();
+  if (model_ || (from<0) || (from>=n) || (to<0) || (to>=n))
+    return -1;
+  if (from==to)
+    return to;
+  
+  tab_positions();
+  if (update_depth_ || (tab_count!=n)) {
+    // The layout will find the children where they moved to once it is made
+    insert(*child(from), (to>from)?to+1:to);
+    return to;
+  }
+  
+  rotate_tabs(from, to);
+  
+  layout_serial_++;
+  redraw_tabs();
+  return to;
+}
+
+/*
+  Tell the close callbacks about the `n' tabs in `kids', which have been removed.
+*/
+void Fl_Scroll_Tabs::closed(Fl_Widget **kids, int n) {
+  if (close_batch_callback_) {
+    close_batch_callback_(kids, n, close_batch_callback_arg_);
+    return;
+  }
+  if (close_callback_) {
+    for (int k = 0; k<n; k++)
+      close_callback_(kids[k], close_callback_arg_);
+  }
+}
+
+/*
+  Close the tabs from `first' to `last' that `pred' chooses, or all of them if
+  it is NULL. The children are compacted in one pass, however scattered the
+  closed ones are, and the tabs are laid out once at the end.
+*/
+int Fl_Scroll_Tabs::close_tabs(int first, int last, Fl_Scroll_Tabs_Close_Pred pred, void *arg) {
+  if (first<0)
+    first = 0;
+  if (last>=tabs())
+    last = tabs()-1;
+  if (first>last)
+    return 0;
+  
+  begin_update();
+  int n = 0;
+  
+  if (model_) {
+    int value = value_index_, value_closed = 0;
+    for (int i = last; i>=first; i--) {
+      if ((pred && !pred(NULL, i, arg)) || !model_->close(i))
+        continue;
+      n++;
+      if (i<value)
+        value--;
+      else if (i==value)
+        value_closed = 1;
+    }
+    if (value_closed) {
+      // Select the tab that took the closed one's place
+      const int count = model_->count();
+      select_model(-1);
+      if (count)
+        select_model((value<count)?value:count-1);
+    }
+    else
+      value_index_ = value;
+    if (n)
+      tabs_changed();
+  }
+  else {
+    // Choose them all before any is removed, so that `pred' sees the tabs as they were
+    unsigned char *const closing = (unsigned char *)malloc(last-first+1);
+    int first_closed = -1;
+    for (int i = first; i<=last; i++) {
+      closing[i-first] = !pred || pred(child(i), i, arg);
+      if (closing[i-first] && (first_closed<0))
+        first_closed = i;
+    }
+    
+    // Fl_Group shifts every later child on each removal, but not when the last
+    // child is removed or one is added at the end. So take the children from the
+    // first closed one on off the end, and add back those that stay, in order.
+    Fl_Widget **const kids = (Fl_Widget **)malloc((last-first+1)*sizeof(Fl_Widget *));
+    if (first_closed>=0) {
+      const int n_taken = children()-first_closed;
+      Fl_Widget **const taken = (Fl_Widget **)malloc(n_taken*sizeof(Fl_Widget *));
+      for (int k = n_taken-1; k>=0; k--) {
+        taken[k] = child(first_closed+k);
+        remove(first_closed+k);
+      }
+      for (int k = 0; k<n_taken; k++) {
+        const int i = first_closed+k;
+        if ((i<=last) && closing[i-first]) {
+          lazy_removed(taken[k]);
+          kids[n++] = taken[k];
+        }
+        else
+          add(taken[k]);
+      }
+      free(taken);
+    }
+    free(closing);
+    
+    if (n) {
+      hover(-1, 0);
+      drag_tab_ = -1;
+      drag_moved_ = 0;
+    }
+    end_update();
+    if (n)
+      closed(kids, n);
+    free(kids);
+    return n;
+  }
+  
+  end_update();
+  return n;
+}
+
+/**
+  Closes every tab that \p pred returns non-zero for, as if its close button
+  was pressed, and lays the tabs out once afterwards. Closing many tabs this
+  way is much quicker than closing them one at a time. Closed groups are
+  passed to the close_batch_callback() together, or else to the
+  close_callback() one at a time. Tabs from a model() are closed with
+  Fl_Scroll_Tabs_Model::close(). Returns the number of tabs closed.
+  \see close_range()
+*/
+int Fl_Scroll_Tabs::close_if(Fl_Scroll_Tabs_Close_Pred pred, void *arg) {
+  if (!pred)
+    return 0;
+  return close_tabs(0, tabs()-1, pred, arg);
+}
+
+/**
+  Closes the tabs from index \p first to \p last inclusive, such as all the tabs
+  to the right of one, the same way as close_if(). Returns the number of tabs closed.
+*/
+int Fl_Scroll_Tabs::close_range(int first, int last) {
+  return close_tabs(first, last, NULL, NULL);
+}
+
+/**
+  Returns the index of the selected tab, or -1 if there are no tabs.
+*/
+int Fl_Scroll_Tabs::value_index() {
+  if (!tabs())
+    return -1;
+  return ensure_value();
+}
+
+#ifdef FL_SCROLL_TABS_STATS
+/**
+  Sets all of the counts in stats() back to zero.
+  Only available when FL_SCROLL_TABS_STATS is defined.
+*/
+void Fl_Scroll_Tabs::reset_stats() {
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+/**
+  Sets a callback to be called after any draw() or layout of the tabs that
+  took longer than \p threshold seconds. Pass NULL to stop calling it.
+  Only available when FL_SCROLL_TABS_STATS is defined.
+*/
+void Fl_Scroll_Tabs::slow_callback(Fl_Scroll_Tabs_Slow_Cb cb, double threshold, void *arg) {
+  slow_cb_ = cb;
+  slow_threshold_ = threshold;
+  slow_arg_ = arg;
+}
+
+void Fl_Scroll_Tabs::timed(int draw, double seconds) {
+  if (draw) {
+    stats_.draws++;
+    int bucket = 0;
+    for (double limit = 0.00025; (bucket<FL_SCROLL_TABS_DRAW_BUCKETS-1) && (seconds>=limit); limit*=2.0)
+      bucket++;
+    stats_.draw_times[bucket]++;
+  }
+  
+  if (slow_cb_ && (seconds>slow_threshold_))
+    slow_cb_(this, draw?"draw":"layout", seconds, slow_arg_);
+}
+#endif
+
+// Fold ASCII letters to lower case, so that finding a tab ignores their case
+static void find_fold(char *to, const char *from, int len) {
+  for (int i = 0; i<len; i++)
+    to[i] = ((from[i]>='A') && (from[i]<='Z'))?from[i]-'A'+'a':from[i];
+  to[len] = '\0';
+}
+
+// Used by qsort() through find_compare(), which has no other way to get them
+static const char *find_sort_pool;
+static const int *find_sort_keys;
+
+// Order tabs by their keys, and tabs with the same key by their index
+static int find_compare(int a, int b) {
+  const int c = strcmp(find_sort_pool+find_sort_keys[a], find_sort_pool+find_sort_keys[b]);
+  return c?c:(a-b);
+}
+
+static int find_qsort_compare(const void *a, const void *b) {
+  return find_compare(*(const int *)a, *(const int *)b);
+}
+
+// Where tab `t' is or would be in the order
+static int find_position(Fl_Scroll_Tabs_Find *f, int t) {
+  find_sort_pool = f->pool;
+  find_sort_keys = f->keys;
+  int first = 0, last = f->count;
+  while (first<last) {
+    const int mid = first+((last-first)>>1);
+    if (find_compare(f->order[mid], t)<0)
+      first = mid+1;
+    else
+      last = mid;
+  }
+  return first;
+}
+
+// Make room for tabs up to `n' in keys, and for them all in order
+static void find_reserve(Fl_Scroll_Tabs_Find *f, int n) {
+  if (n<=f->capacity)
+    return;
+  if (n<f->capacity+(f->capacity>>1))
+    n = f->capacity+(f->capacity>>1);
+  f->order = (int *)realloc(f->order, n*sizeof(int));
+  f->keys = (int *)realloc(f->keys, n*sizeof(int));
+  f->blocks = (int *)realloc(f->blocks, n*sizeof(int));
+  for (int i = f->capacity; i<n; i++)
+    f->keys[i] = -1;
+  f->capacity = n;
+}
+
+// Add the key of tab `t' to the pool
+static void find_add_key(Fl_Scroll_Tabs_Find *f, int t, const char *label) {
+  const int len = label?strlen(label):0;
+  if (f->pool_used+len+1>f->pool_size) {
+    int size = f->pool_size+(f->pool_size>>1);
+    if (size<f->pool_used+len+1)
+      size = f->pool_used+len+1;
+    if (size<256)
+      size = 256;
+    f->pool = (char *)realloc(f->pool, size);
+    f->pool_size = size;
+  }
+  find_fold(f->pool+f->pool_used, label?label:"", len);
+  f->keys[t] = f->pool_used;
+  f->pool_used += len+1;
+}
+
+// Take tab `t' out of the order
+static void find_remove(Fl_Scroll_Tabs_Find *f, int t) {
+  if (f->keys[t]<0)
+    return;
+  const int at = find_position(f, t);
+  memmove(f->order+at, f->order+at+1, (f->count-at-1)*sizeof(int));
+  f->count--;
+  f->blocks_valid = 0;
+  f->pool_garbage += strlen(f->pool+f->keys[t])+1;
+  f->keys[t] = -1;
+}
+
+/*
+  Make the index from every tab, which must be laid out.
+*/
+void Fl_Scroll_Tabs::build_find_index() {
+  Fl_Scroll_Tabs_Find *const f = find_;
+  find_reserve(f, tab_count);
+  f->pool_used = f->pool_garbage = 0;
+  for (int i = 0; i<f->capacity; i++)
+    f->keys[i] = -1;
+  for (int i = 0; i<tab_count; i++) {
+    find_add_key(f, i, tab_label_ptrs[i]);
+    f->order[i] = i;
+  }
+  f->count = tab_count;
+  
+  find_sort_pool = f->pool;
+  find_sort_keys = f->keys;
+  qsort(f->order, f->count, sizeof(int), find_qsort_compare);
+  f->valid = 1;
+  f->blocks_valid = 0;
+}
+
+void Fl_Scroll_Tabs::find_changed(int i, const char *label) {
+  Fl_Scroll_Tabs_Find *const f = find_;
+  if (!f || !f->valid)
+    return;
+  
+  // Many changes, like a tab inserted before many others, are quicker to sort again
+  if ((++f->changes>FIND_MAXIMUM_CHANGES) || (f->pool_garbage>(f->pool_used>>1)+1024)) {
+    f->valid = 0;
+    return;
+  }
+  
+  find_reserve(f, i+1);
+  find_remove(f, i);
+  find_add_key(f, i, label);
+  const int at = find_position(f, i);
+  memmove(f->order+at+1, f->order+at, (f->count-at)*sizeof(int));
+  f->order[at] = i;
+  f->count++;
+  f->blocks_valid = 0;
+}
+
+void Fl_Scroll_Tabs::find_removed(int i) {
+  Fl_Scroll_Tabs_Find *const f = find_;
+  if (!f || !f->valid)
+    return;
+  
+  if (++f->changes>FIND_MAXIMUM_CHANGES) {
+    f->valid = 0;
+    return;
+  }
+  find_remove(f, i);
+}
+
+static int compare_ints(const void *a, const void *b) {
+  const int x = *(const int *)a, y = *(const int *)b;
+  return (x<y)?-1:(x>y);
+}
+
+/*
+  The first tab after `after' among order[first] to order[last-1], or else the
+  lowest of them, or -1 if there are none. Whole blocks are searched in their
+  sorted copy in O(log FIND_BLOCK), so only the entries at the ends of the range
+  are looked at one by one, however many tabs start with the same text.
+*/
+static int find_in_range(Fl_Scroll_Tabs_Find *f, int first, int last, int after) {
+  if (!f->blocks_valid) {
+    memcpy(f->blocks, f->order, f->count*sizeof(int));
+    for (int b = 0; b<f->count; b += FIND_BLOCK)
+      qsort(f->blocks+b, (f->count-b<FIND_BLOCK)?f->count-b:FIND_BLOCK, sizeof(int), compare_ints);
+    f->blocks_valid = 1;
+  }
+  
+  int found = -1, lowest = -1;
+  for (int k = first; k<last; ) {
+    if (!(k%FIND_BLOCK) && (k+FIND_BLOCK<=last)) {
+      const int *const block = f->blocks+k;
+      int lo = 0, hi = FIND_BLOCK;
+      while (lo<hi) {
+        const int mid = (lo+hi)>>1;
+        if (block[mid]<=after)
+          lo = mid+1;
+        else
+          hi = mid;
+      }
+      if ((lo<FIND_BLOCK) && ((found<0) || (block[lo]<found)))
+        found = block[lo];
+      if ((lowest<0) || (block[0]<lowest))
+        lowest = block[0];
+      k += FIND_BLOCK;
+    }
+    else {
+      const int t = f->order[k++];
+      if ((t>after) && ((found<0) || (t<found)))
+        found = t;
+      if ((lowest<0) || (t<lowest))
+        lowest = t;
+    }
+  }
+  return (found<0)?lowest:found;
+}
+
+/**
+  Finds the first tab after tab \p after whose label starts with \p text,
+  going round to the first tab after the last. If no label starts with it,
+  finds the first one containing it instead. The case of ASCII letters is ignored.
+  Returns the index of the tab, or -1 if no label contains \p text
+  or this is called between begin_update() and end_update().
+
+  The labels are indexed by the first call, and the index is kept up to date
+  as tabs are added, removed and relabelled, so that finding a tab whose label
+  starts with \p text among tens of thousands is O(log n) and does not measure
+  or compare every label. Finding a label that only contains \p text is not
+  indexed, and compares every label.
+  \see jump_to_tab()
+*/
+int Fl_Scroll_Tabs::find_tab(const char *text, int after) {
+  // The layout may still have tabs that were removed
+  if (update_depth_)
+    return -1;
+  tab_positions();
+  const int n = tab_count;
+  if (!n || !text)
+    return -1;
+  
+  if (!find_)
+    find_ = (Fl_Scroll_Tabs_Find *)calloc(1, sizeof(Fl_Scroll_Tabs_Find));
+  if (!find_->valid)
+    build_find_index();
+  Fl_Scroll_Tabs_Find *const f = find_;
+  
+  if ((after<-1) || (after>=n))
+    after = -1;
+  
+  const int len = strlen(text);
+  char *const folded = (char *)malloc(len+1);
+  find_fold(folded, text, len);
+  
+  // The labels starting with the text are together in the order, from the first not less than it
+  int first = 0, last = f->count;
+  while (first<last) {
+    const int mid = first+((last-first)>>1);
+    if (strcmp(f->pool+f->keys[f->order[mid]], folded)<0)
+      first = mid+1;
+    else
+      last = mid;
+  }
+  // to the first that is past them
+  int end = first;
+  last = f->count;
+  while (end<last) {
+    const int mid = end+((last-end)>>1);
+    if (strncmp(f->pool+f->keys[f->order[mid]], folded, len)<=0)
+      end = mid+1;
+    else
+      last = mid;
+  }
+  
+  int found = find_in_range(f, first, end, after);
+  
+  // Not indexed, see above
+
+  for (int k = 1; (found<0) && (k<=n); k++) {
+    const int t = (after+k)%n;
+    if (strstr(f->pool+f->keys[t], folded))
+      found = t;
+  }
+  
+  free(folded);
+  return found;
+}
+
+/**
+  Selects the first tab after the selected one whose label starts with,
+  or else contains, \p text, and scrolls it into view.
+  Returns the index of the tab, or -1 if there is none.
+  \see find_tab()
+*/
+int Fl_Scroll_Tabs::jump_to_tab(const char *text) {
+  const int i = find_tab(text, value_index());
+  if (i>=0)
+    push(i);
+  return i;
+}
+
+/*
+  Keys pressed while the tabs have the focus. The left and right arrows select
+  the tab beside the selected one, and typing finds a tab by its label.
+  Typing the same character again goes on to the next tab starting with it.
+*/
+int Fl_Scroll_Tabs::handle_key() {
+  const int n = tabs();
+  if (!n)
+    return 0;
+  const int v = value_index();
+  
+  if (!find_)
+    find_ = (Fl_Scroll_Tabs_Find *)calloc(1, sizeof(Fl_Scroll_Tabs_Find));
+  Fl_Scroll_Tabs_Find *const f = find_;
+  
+  switch (Fl::event_key()) {
+    case FL_Left:
+      f->text_len = 0;
+      if (v>0)
+        push(v-1);
+      return 1;
+    case FL_Right:
+      f->text_len = 0;
+      if (v<n-1)
+        push(v+1);
+      return 1;
+    case FL_BackSpace:
+      if (!f->text_len)
+        return 0;
+      f->text_len = fl_utf8back(f->text+f->text_len-1, f->text, f->text+f->text_len)-f->text;
+      f->text[f->text_len] = '\0';
+      f->text_time = scroll_clock();
+      if (f->text_len) {
+        const int i = find_tab(f->text, v-1);
+        if (i>=0)
+          push(i);
+      }
+      return 1;
+    case FL_Escape:
+      if (!f->text_len)
+        return 0;
+      f->text_len = 0;
+      return 1;
+  }
+  
+  const char *const text = Fl::event_text();
+  const int len = Fl::event_length();
+  if (Fl::event_state(FL_CTRL|FL_ALT|FL_META) || (len<=0) || ((unsigned char)text[0]<' ') || (text[0]==127))
+    return 0;
+  
+  const double now = scroll_clock();
+  if (now-f->text_time>FIND_TIMEOUT)
+    f->text_len = 0;
+  f->text_time = now;
+  if (f->text_len+len>=FIND_TEXT_SIZE)
+    return 1;
+  memcpy(f->text+f->text_len, text, len);
+  f->text_len += len;
+  f->text[f->text_len] = '\0';
+  
+  // The same character again looks for the next tab starting with it.
+  // Otherwise the selected tab is kept while it still matches.
+  int same = f->text_len>len;
+  for (int i = len; same && (i<f->text_len); i++)
+    same = f->text[i]==f->text[i%len];
+  
+  int i;
+  if (same) {
+    const char c = f->text[len];
+    f->text[len] = '\0';
+    i = find_tab(f->text, v);
+    f->text[len] = c;
+  }
+  else
+    i = find_tab(f->text, (f->text_len==len)?v:v-1);
+  if (i>=0)
+    push(i);
+  return 1;
+}
+
+/*
+  Measuring tabs in the background. Tabs laid out many at once are given
+  estimated widths, then start_async_job() copies what they are measured
+  from to a job and measures them on another thread with an
+  Fl_Scroll_Tabs_Metrics, which must not use anything FLTK draws with.
+  The measurements are handed back a chunk at a time through Fl::awake(),
+  with at most one call waiting at a time.
+*/
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION Fl_Scroll_Tabs_Mutex;
+#define async_mutex_init(m) InitializeCriticalSection(&(m))
+#define async_mutex_destroy(m) DeleteCriticalSection(&(m))
+#define async_lock(m) EnterCriticalSection(&(m))
+#define async_unlock(m) LeaveCriticalSection(&(m))
+#define async_sleep() Sleep(1)
+#else
+typedef pthread_mutex_t Fl_Scroll_Tabs_Mutex;
+#define async_mutex_init(m) pthread_mutex_init(&(m), NULL)
+#define async_mutex_destroy(m) pthread_mutex_destroy(&(m))
+#define async_lock(m) pthread_mutex_lock(&(m))
+#define async_unlock(m) pthread_mutex_unlock(&(m))
+#define async_sleep() usleep(1000)
+#endif
+
+/*
+  The default metrics: the advances of the printable ASCII characters and of
+  "...", copied from the glyph cache before the job starts. Anything else is
+  left to be measured on the user interface thread.
+*/
+class Fl_Scroll_Tabs_Table_Metrics : public Fl_Scroll_Tabs_Metrics {
+public:
+  int count;
+  Fl_Font fonts[ASYNC_FONTS];
+  Fl_Fontsize sizes[ASYNC_FONTS];
+  double advances[ASYNC_FONTS][96];  // ' ' to '~', then "..."
+  
+  Fl_Scroll_Tabs_Table_Metrics() : count(0) {}
+  
+  // Copy the advances of a font from the glyph cache
+  void add(Fl_Font font, Fl_Fontsize size) {
+    for (int f = 0; f<count; f++) {
+      if ((fonts[f]==font) && (sizes[f]==size))
+        return;
+    }
+    if (count==ASYNC_FONTS)
+      return;
+    int font_set = 0;
+    for (int c = ' '; c<='~'; c++)
+      advances[count][c-' '] = glyph_advance(font, size, c, font_set);
+    advances[count][95] = glyph_advance(font, size, ELLIPSIS_GLYPH, font_set);
+    fonts[count] = font;
+    sizes[count] = size;
+    count++;
+  }
+  
+  virtual double width(const char *text, int len, Fl_Font font, Fl_Fontsize size) {
+    int f = 0;
+    while ((f<count) && ((fonts[f]!=font) || (sizes[f]!=size)))
+      f++;
+    if (f==count)
+      return -1.0;
+    if ((len==3) && !memcmp(text, "...", 3))
+      return advances[f][95];
+    
+    // Summed in the same order as cached_label_width(), so the widths are the same
+    double sum = 0.0;
+    for (int k = 0; k<len; k++) {
+      const unsigned char c = text[k];
+      if ((c<' ') || (c>'~') || (c=='&'))
+        return -1.0;
+      sum += advances[f][c-' '];
+    }
+    return sum;
+  }
+};
+
+struct Fl_Scroll_Tabs_Job {
+  Fl_Scroll_Tabs_Mutex mutex;  // guards the members down to finished
+  int refs;  // held by the widget, the thread and a waiting Fl::awake() call
+  int cancelled;
+  int published;  // tabs measured so far
+  int merge_waiting;  // an Fl::awake() call is waiting to hand them back
+  int finished;
+  
+  // Only used by the user interface thread
+  Fl_Scroll_Tabs *owner;  // NULL once cancelled
+  int merged;  // measurements handed back so far
+  
+  // What each tab is measured from, copied so that the thread needs nothing else
+  int count;
+  int *index;
+  Fl_Widget **kids;
+  unsigned *hashes;
+  Fl_Font *fonts;
+  Fl_Fontsize *sizes;
+  int *text_offsets, *lengths;
+  char *text;
+  int max_w;
+  Fl_Scroll_Tabs_Metrics *metrics;
+  Fl_Scroll_Tabs_Table_Metrics *own_metrics;
+  
+  // Each tab's label width, or -1 if the metrics can't measure it,
+  // and the length its label is cut to before an ellipsis, or -1
+  int *widths, *cuts;
+};
+
+static void async_release(Fl_Scroll_Tabs_Job *job) {
+  async_lock(job->mutex);
+  const int refs = --job->refs;
+  async_unlock(job->mutex);
+  if (refs)
+    return;
+  
+  async_mutex_destroy(job->mutex);
+  free(job->index);
+  free(job->kids);
+  free(job->hashes);
+  free(job->fonts);
+  free(job->sizes);
+  free(job->text_offsets);
+  free(job->lengths);
+  free(job->text);
+  free(job->widths);
+  free(job->cuts);
+  delete job->own_metrics;
+  free(job);
+}
+
+// Let the user interface thread know `done' tabs are measured
+static void async_publish(Fl_Scroll_Tabs_Job *job, int done, int finished) {
+  async_lock(job->mutex);
+  job->published = done;
+  job->finished = finished;
+  const int call = !job->merge_waiting && !job->cancelled;
+  if (call) {
+    job->merge_waiting = 1;
+    job->refs++;
+  }
+  async_unlock(job->mutex);
+  
+  // Fl::awake() fails while its queue is full
+  while (call && (Fl::awake(Fl_Scroll_Tabs::async_merge_cb, job)<0))
+    async_sleep();
+}
+
+// Measure one tab the way cached_label_width() does, with the job's metrics
+static void async_measure_tab(Fl_Scroll_Tabs_Job *job, int k, int *cut_offsets) {
+  const char *const t = job->text+job->text_offsets[k];
+  const int len = job->lengths[k];
+  Fl_Font font = job->fonts[k];
+  Fl_Fontsize size = job->sizes[k];
+  
+  job->cuts[k] = -1;
+  const double w = len?job->metrics->width(t, len, font, size):0.0;
+  if (w<0.0) {
+    job->widths[k] = -1;
+    return;
+  }
+  
+  const int full_w = (int)ceil(w);
+  if ((job->max_w==-1) || (full_w<job->max_w)) {
+    job->widths[k] = full_w;
+    return;
+  }
+  
+  const double ellipsis = job->metrics->width("...", 3, font, size);
+  if (ellipsis<0.0) {
+    job->widths[k] = -1;
+    return;
+  }
+  
+  // The places the label may be cut, longest first, as label_cuts() finds them
+  int n_cuts = 0;
+  for (int end = len; end>0; ) {
+    cut_offsets[n_cuts++] = end;
+    do
+      end--;
+    while ((end>0) && ((t[end]&0xC0)==0x80));
+  }
+  
+  int first = 0, last = n_cuts;
+  while (first<last) {
+    const int mid = first+((last-first)>>1);
+    const double cut_w = job->metrics->width(t, cut_offsets[mid], font, size);
+    if ((cut_w>=0.0) && ((int)ceil(cut_w+ellipsis)<job->max_w))
+      last = mid;
+    else
+      first = mid+1;
+  }
+  if (first==n_cuts)
+    first = n_cuts-1;
+  
+  const double cut_w = job->metrics->width(t, cut_offsets[first], font, size);
+  job->widths[k] = (cut_w<0.0)?-1:(int)ceil(cut_w+ellipsis);
+  job->cuts[k] = cut_offsets[first];
+}
+
+static void async_measure(Fl_Scroll_Tabs_Job *job) {
+  int longest = 1;
+  for (int k = 0; k<job->count; k++) {
+    if (job->lengths[k]>longest)
+      longest = job->lengths[k];
+  }
+  int *const cut_offsets = (int *)malloc(longest*sizeof(int));
+  
+  int k = 0;
+  while (k<job->count) {
+    const int end = (k+ASYNC_CHUNK<job->count)?k+ASYNC_CHUNK:job->count;
+    for (; k<end; k++)
+      async_measure_tab(job, k, cut_offsets);
+    
+    async_lock(job->mutex);
+    const int cancelled = job->cancelled;
+    async_unlock(job->mutex);
+    if (cancelled)
+      break;
+    if (k<job->count)
+      async_publish(job, k, 0);
+  }
+  async_publish(job, k, 1);
+  
+  free(cut_offsets);
+  async_release(job);
+}
+
+#ifdef _WIN32
+static unsigned __stdcall async_thread(void *job) {
+  async_measure((Fl_Scroll_Tabs_Job *)job);
+  return 0;
+}
+#else
+static void *async_thread(void *job) {
+  async_measure((Fl_Scroll_Tabs_Job *)job);
+  return NULL;
+}
+#endif
+
+// Start measuring every tab that has an estimated width in the background
+void Fl_Scroll_Tabs::start_async_job() {
+  async_pending_ = 0;
+  
+  int count = 0, text_size = 0;
+  for (int i = 0; i<tab_count; i++) {
+    if (tab_estimated[i]) {
+      count++;
+      text_size += strlen(tab_label(i))+1;
+    }
+  }
+  if (!count)
+    return;
+  
+  Fl_Scroll_Tabs_Job *const job = (Fl_Scroll_Tabs_Job *)calloc(1, sizeof(Fl_Scroll_Tabs_Job));
+  async_mutex_init(job->mutex);
+  job->refs = 2;
+  job->owner = this;
+  job->count = count;
+  job->index = (int *)malloc(count*sizeof(int));
+  job->kids = (Fl_Widget **)malloc(count*sizeof(Fl_Widget *));
+  job->hashes = (unsigned *)malloc(count*sizeof(unsigned));
+  job->fonts = (Fl_Font *)malloc(count*sizeof(Fl_Font));
+  job->sizes = (Fl_Fontsize *)malloc(count*sizeof(Fl_Fontsize));
+  job->text_offsets = (int *)malloc(count*sizeof(int));
+  job->lengths = (int *)malloc(count*sizeof(int));
+  job->text = (char *)malloc(text_size);
+  job->widths = (int *)malloc(count*sizeof(int));
+  job->cuts = (int *)malloc(count*sizeof(int));
+  job->max_w = maximum_label_width();
+  if (async_metrics_)
+    job->metrics = async_metrics_;
+  else
+    job->metrics = job->own_metrics = new Fl_Scroll_Tabs_Table_Metrics;
+  
+  // An estimated tab's whole label is what it is drawn with
+  int k = 0, at = 0;
+  for (int i = 0; i<tab_count; i++) {
+    if (!tab_estimated[i])
+      continue;
+    const int len = strlen(tab_label(i));
+    job->index[k] = i;
+    job->kids[k] = tab_kids[i];
+    job->hashes[k] = tab_label_hashes[i];
+    job->fonts[k] = tab_fonts[i];
+    job->sizes[k] = tab_sizes[i];
+    job->text_offsets[k] = at;
+    job->lengths[k] = len;
+    memcpy(job->text+at, tab_label(i), len+1);
+    at += len+1;
+    if (job->own_metrics)
+      job->own_metrics->add(tab_fonts[i], tab_sizes[i]);
+    k++;
+  }
+  
+#ifdef _WIN32
+  const HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, async_thread, job, 0, NULL);
+  const int started = thread!=0;
+  if (started)
+    CloseHandle(thread);
+#else
+  pthread_t thread;
+  const int started = !pthread_create(&thread, NULL, async_thread, job);
+  if (started)
+    pthread_detach(thread);
+#endif
+  
+  if (!started) {
+    // Measure them here instead
+    job->refs = 1;
+    job->cancelled = 1;
+    async_release(job);
+    for (int i = 0; i<tab_count; i++) {
+      if (tab_estimated[i])
+        measure_tab(i, 1, 0);
+    }
+    return;
+  }
+  
+  async_job_ = job;
+}
+
+// Stop the background measuring. Tabs it had not handed back keep their estimated widths.
+void Fl_Scroll_Tabs::cancel_async_job() {
+  Fl_Scroll_Tabs_Job *const job = async_job_;
+  if (!job)
+    return;
+  
+  async_lock(job->mutex);
+  job->cancelled = 1;
+  async_unlock(job->mutex);
+  job->owner = NULL;
+  async_job_ = NULL;
+  async_pending_ = 1;
+  async_release(job);
+}
+
+/*
+  Called through Fl::awake() on the user interface thread with the
+  measurements made so far.
+*/
+void Fl_Scroll_Tabs::async_merge_cb(void *v) {
+  Fl_Scroll_Tabs_Job *const job = (Fl_Scroll_Tabs_Job *)v;
+  async_lock(job->mutex);
+  const int published = job->published, finished = job->finished;
+  job->merge_waiting = 0;
+  async_unlock(job->mutex);
+  
+  if (job->owner)
+    job->owner->async_merge(job, published, finished);
+  async_release(job);
+}
+
+void Fl_Scroll_Tabs::async_merge(Fl_Scroll_Tabs_Job *job, int published, int finished) {
+  // Keep the first visible tab where it is, however the widths before it change
+  const int anchor = (offset>0)?tab_at(offset):-1;
+  const long within = (anchor>=0)?(long)offset-tab_start(anchor):0;
+  
+  const int tab_label_padding = Fl::box_dw(FL_DOWN_BOX)+(TAB_SELECTION_BORDER<<1)+(closebutton_?button_width_:0);
+  int changed = 0;
+  for (int k = job->merged; k<published; k++) {
+    const int i = job->index[k];
+    
+    // Tabs changed since the job started are measured again by another one
+    if ((i>=tab_count) || !tab_estimated[i] || (tab_kids[i]!=job->kids[k]) || (tab_label_hashes[i]!=job->hashes[k]) ||
+        (tab_fonts[i]!=job->fonts[k]) || (tab_sizes[i]!=job->sizes[k])) {
+      async_pending_ = 1;
+      continue;
+    }
+    
+    if (job->widths[k]<0) {
+      // The metrics couldn't measure it. Between begin_update() and end_update() the child may be gone.
+      if (update_depth_)
+        async_pending_ = 1;
+      else
+        measure_tab(i, 1, 0);
+      changed = 1;
+      continue;
+    }
+    
+    const char *const text = job->text+job->text_offsets[k];
+    if (job->cuts[k]<0)
+      memcpy(label_space(i, job->lengths[k]+1), text, job->lengths[k]+1);
+    else {
+      char *const l = label_space(i, job->cuts[k]+4);
+      memcpy(l, text, job->cuts[k]);
+      strcpy(l+job->cuts[k], "...");
+    }
+    
+    const int old_width = tab_width[i];
+    tab_width[i] = minimum_label_width(job->widths[k])+tab_label_padding;
+    tree_add(i, tab_width[i]-old_width);
+    tab_estimated[i] = 0;
+    changed = 1;
+  }
+  job->merged = published;
+  
+  if (changed) {
+    if ((anchor>=0) && (anchor<tab_count)) {
+      long o = tab_start(anchor)+within;
+      if (o>max_offset())
+        o = max_offset();
+      if (o<0)
+        o = 0;
+      if (scroll_target_>=0.0)
+        scroll_target_ += o-(long)offset;
+      offset = o;
+    }
+    layout_serial_++;
+    compact_labels();
+    redraw_tabs();
+  }
+  
+  if (finished) {
+    async_job_ = NULL;
+    job->owner = NULL;
+    async_release(job);
+    if (async_pending_ && !update_depth_)
+      start_async_job();
+  }
+}
+
+/**
+  Sets whether many tabs laid out at once, such as after adding thousands of
+  them, are measured in the background. Until they are, they get widths
+  guessed from the length of their labels, and the tabs can be used straight
+  away. The measurements are handed back through Fl::awake(), so the
+  application must have called Fl::lock(). Off by default.
+  \see async_metrics()
+*/
+void Fl_Scroll_Tabs::async_layout(int a) {
+  async_ = (a!=0);
+  if (!async_) {
+    // Measure any guessed widths now
+    cancel_async_job();
+    async_pending_ = 0;
+    invalidate_layout();
+    redraw();
+  }
+}
+
+/**
+  Sets what measures labels in the background, or NULL for the default, which
+  knows the widths of ASCII characters in the fonts of the tabs and leaves
+  other labels to be measured on the user interface thread. \p m must be safe
+  to call from another thread while the user interface draws, and outlive
+  any measuring it was given to.
+  \see async_layout(int)
+*/
+void Fl_Scroll_Tabs::async_metrics(Fl_Scroll_Tabs_Metrics *m) {
+  async_metrics_ = m;
+}
+
+/**
+  Gives every tab the same width \p w in pixels, including its close button,
+  cutting labels short to fit as they are drawn. Labels are then never measured,
+  so laying out many tabs costs no more than counting them, and finding the
+  tab at a position is O(1). The tab_size_range() is not used. Pass 0 to make
+  tabs as wide as their labels again, which is the default.
+*/
+void Fl_Scroll_Tabs::fixed_tab_width(int w) {
+  fixed_w_ = (w>0)?w:0;
+  invalidate_layout();
+  redraw();
+}
+
+/*
+  The command queue. Producers push commands onto a Treiber stack with a
+  compare and swap, and the one that finds no Fl::awake() call waiting asks
+  for one. The user interface thread takes the whole stack at once and
+  reverses it, so commands are applied in the order they were posted.
+  Only the user interface thread takes commands off, so there is no ABA problem.
+*/
+#ifdef _WIN32
+#define queue_add(p, d) (InterlockedExchangeAdd((volatile LONG *)(p), (d))+(d))
+#define queue_cas(p, o, n) (InterlockedCompareExchange((volatile LONG *)(p), (n), (o))==(o))
+#define queue_cas_ptr(p, o, n) (InterlockedCompareExchangePointer((PVOID volatile *)(p), (n), (o))==(o))
+#define queue_take(p) ((Fl_Scroll_Tabs_Command *)InterlockedExchangePointer((PVOID volatile *)(p), NULL))
+#else
+#define queue_add(p, d) __sync_add_and_fetch((p), (d))
+#define queue_cas(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#define queue_cas_ptr(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#define queue_take(p) ((Fl_Scroll_Tabs_Command *)__sync_lock_test_and_set((p), (Fl_Scroll_Tabs_Command *)NULL))
+#endif
+
+#define QUEUE_ADD 0
+#define QUEUE_RELABEL 1
+#define QUEUE_CLOSE 2
+#define QUEUE_RELABEL_SEARCHES 16  // relabelled tabs found one by one, see apply_commands()
+
+struct Fl_Scroll_Tabs_Command {
+  Fl_Scroll_Tabs_Command *next;
+  int op;
+  void *key;
+  char label[1];  // and the rest of the label
+};
+
+// Hash of a key. Keys may be small integers, so every bit counts.
+static unsigned key_hash(const void *key) {
+  unsigned long long h = (unsigned long long)(size_t)key*0x9E3779B97F4A7C15ull;
+  return (unsigned)(h>>32);
+}
+
+Fl_Scroll_Tabs_Queue::Fl_Scroll_Tabs_Queue(Fl_Scroll_Tabs *owner)
+  : head_(NULL)
+  , refs_(1)
+  , pending_(0)
+  , stalled_(0)
+  , owner_(owner)
+  , load_(NULL)
+  , unload_(NULL)
+  , arg_(NULL)
+  , table_(NULL)
+  , table_size_(0)
+  , table_used_(0) {
+  Fl::add_check(check_cb, this);
+}
+
+Fl_Scroll_Tabs_Queue::~Fl_Scroll_Tabs_Queue() {
+  Fl_Scroll_Tabs_Command *c = queue_take(&head_);
+  while (c) {
+    Fl_Scroll_Tabs_Command *const next = c->next;
+    free(c);
+    c = next;
+  }
+  free(table_);
+}
+
+/**
+  Keeps the queue for one more user, such as another thread posting to it.
+  \see release()
+*/
+void Fl_Scroll_Tabs_Queue::retain() {
+  queue_add(&refs_, 1);
+}
+
+/**
+  Gives up a reference from command_queue() or retain(). The queue is deleted
+  once the widget and every user have given theirs up, so a thread may keep
+  posting after the widget is deleted; its commands are then dropped.
+*/
+void Fl_Scroll_Tabs_Queue::release() {
+  if (queue_add(&refs_, -1)==0)
+    delete this;
+}
+
+void Fl_Scroll_Tabs_Queue::post(int op, void *key, const char *label) {
+  const size_t len = label?strlen(label):0;
+  Fl_Scroll_Tabs_Command *const c = (Fl_Scroll_Tabs_Command *)malloc(sizeof(Fl_Scroll_Tabs_Command)+len);
+  c->op = op;
+  c->key = key;
+  memcpy(c->label, label?label:"", len+1);
+  
+  Fl_Scroll_Tabs_Command *head;
+  do {
+    head = head_;
+    c->next = head;
+  } while (!queue_cas_ptr(&head_, head, c));
+  
+  // The waiting call will take this command too
+  if (!queue_cas(&pending_, 0, 1))
+    return;
+  retain();
+  if (Fl::awake(awake_cb, this)<0) {
+    // Fl::awake()'s queue is full, so the user interface thread is about to
+    // wake up anyway. Leave it to check_cb() then, keeping pending_ and the reference.
+    queue_cas(&stalled_, 0, 1);
+  }
+}
+
+/**
+  Adds a tab labelled \p label for \p key, made with Fl_Scroll_Tabs::add_lazy()
+  and the callbacks given to Fl_Scroll_Tabs::command_queue(), or relabels it if
+  the key already has one. May be called from any thread. \p label is copied.
+*/
+void Fl_Scroll_Tabs_Queue::add(void *key, const char *label) {
+  post(QUEUE_ADD, key, label);
+}
+
+/**
+  Changes the label of the tab for \p key. May be called from any thread. \p label is copied.
+*/
+void Fl_Scroll_Tabs_Queue::relabel(void *key, const char *label) {
+  post(QUEUE_RELABEL, key, label);
+}
+
+/**
+  Closes the tab for \p key, as if its close button was pressed. May be called from any thread.
+*/
+void Fl_Scroll_Tabs_Queue::close(void *key) {
+  post(QUEUE_CLOSE, key, NULL);
+}
+
+// Called through Fl::awake() on the user interface thread
+void Fl_Scroll_Tabs_Queue::awake_cb(void *v) {
+  Fl_Scroll_Tabs_Queue *const queue = (Fl_Scroll_Tabs_Queue *)v;
+  
+  // Commands posted after the stack is taken need another call
+  queue_cas(&queue->pending_, 1, 0);
+  Fl_Scroll_Tabs_Command *c = queue_take(&queue->head_), *list = NULL;
+  while (c) {
+    Fl_Scroll_Tabs_Command *const next = c->next;
+    c->next = list;
+    list = c;
+    c = next;
+  }
+  
+  if (queue->owner_)
+    queue->owner_->apply_commands(list);
+  while (list) {
+    Fl_Scroll_Tabs_Command *const next = list->next;
+    free(list);
+    list = next;
+  }
+  queue->release();
+}
+
+/*
+  Called on the user interface thread before FLTK waits for events. Applies
+  the commands whose Fl::awake() call failed, without waiting for another post.
+*/
+void Fl_Scroll_Tabs_Queue::check_cb(void *v) {
+  Fl_Scroll_Tabs_Queue *const queue = (Fl_Scroll_Tabs_Queue *)v;
+  if (queue->stalled_ && queue_cas(&queue->stalled_, 1, 0))
+    awake_cb(queue);
+}
+
+// The tab added for `key' that is still one of ours, or NULL
+Fl_Scroll_Tabs_Lazy *Fl_Scroll_Tabs_Queue::lookup(void *key) {
+  if (!table_used_)
+    return NULL;
+  for (unsigned h = key_hash(key)&(table_size_-1); table_[h]; h = (h+1)&(table_size_-1)) {
+    Fl_Scroll_Tabs_Lazy *const page = table_[h];
+    if (page->queue_key_!=key)
+      continue;
+    if (page->parent()==owner_)
+      return page;
+    // Taken out of the tabs some other way
+    forget(page);
+    return NULL;
+  }
+  return NULL;
+}
+
+void Fl_Scroll_Tabs_Queue::remember(Fl_Scroll_Tabs_Lazy *page) {
+  if ((table_used_+1)*2>table_size_) {
+    Fl_Scroll_Tabs_Lazy **const old = table_;
+    const int old_size = table_size_;
+    table_size_ = old_size?old_size<<1:64;
+    table_ = (Fl_Scroll_Tabs_Lazy **)calloc(table_size_, sizeof(Fl_Scroll_Tabs_Lazy *));
+    for (int k = 0; k<old_size; k++) {
+      if (!old[k])
+        continue;
+      unsigned h = key_hash(old[k]->queue_key_)&(table_size_-1);
+      while (table_[h])
+        h = (h+1)&(table_size_-1);
+      table_[h] = old[k];
+    }
+    free(old);
+  }
+  
+  unsigned h = key_hash(page->queue_key_)&(table_size_-1);
+  while (table_[h])
+    h = (h+1)&(table_size_-1);
+  table_[h] = page;
+  table_used_++;
+  page->queue_ = this;
+}
+
+void Fl_Scroll_Tabs_Queue::forget(Fl_Scroll_Tabs_Lazy *page) {
+  page->queue_ = NULL;
+  unsigned h = key_hash(page->queue_key_)&(table_size_-1);
+  while (table_[h]!=page)
+    h = (h+1)&(table_size_-1);
+  
+  // Move later entries of the run back into the gap, so that lookups still find them
+  for (unsigned next = (h+1)&(table_size_-1); table_[next]; next = (next+1)&(table_size_-1)) {
+    const unsigned home = key_hash(table_[next]->queue_key_)&(table_size_-1);
+    if (((next-home)&(table_size_-1))>=((next-h)&(table_size_-1))) {
+      table_[h] = table_[next];
+      h = next;
+    }
+  }
+  table_[h] = NULL;
+  table_used_--;
+}
+
+// The widget is being deleted. Tabs it had may outlive the queue.
+void Fl_Scroll_Tabs_Queue::detach() {
+  owner_ = NULL;
+  Fl::remove_check(check_cb, this);
+  // The reference of a post that check_cb() was left to
+  if (stalled_ && queue_cas(&stalled_, 1, 0))
+    release();
+  for (int k = 0; k<table_size_; k++) {
+    if (table_[k])
+      table_[k]->queue_ = NULL;
+  }
+  table_used_ = 0;
+  memset(table_, 0, table_size_*sizeof(Fl_Scroll_Tabs_Lazy *));
+}
+
+/**
+  Returns the queue that other threads post tabs to add, relabel or close
+  through, made the first time this is called. Tabs it adds are made with
+  add_lazy(), \p load, \p unload and \p arg. The caller must release() the
+  queue when it is done with it, and retain() it for each more thread that uses it.
+  Commands are ignored while the tabs come from a model().
+  \see Fl_Scroll_Tabs_Queue
+*/
+Fl_Scroll_Tabs_Queue *Fl_Scroll_Tabs::command_queue(Fl_Scroll_Tabs_Load_Cb load, Fl_Scroll_Tabs_Unload_Cb unload, void *arg) {
+  if (!queue_)
+    queue_ = new Fl_Scroll_Tabs_Queue(this);
+  queue_->load_ = load;
+  queue_->unload_ = unload;
+  queue_->arg_ = arg;
+  queue_->retain();
+  return queue_;
+}
+
+// Apply commands from the queue, in order, with one layout and one redraw
+void Fl_Scroll_Tabs::apply_commands(Fl_Scroll_Tabs_Command *list) {
+  // The tabs of a model are changed through the model
+  if (model_)
+    return;
+  
+  Fl_Scroll_Tabs_Queue *const queue = queue_;
+  Fl_Widget **kids = NULL, **relabelled = NULL;
+  int n_closed = 0, closed_size = 0, n_relabelled = 0, relabelled_size = 0;
+  
+  begin_update();
+  for (Fl_Scroll_Tabs_Command *c = list; c; c = c->next) {
+    Fl_Scroll_Tabs_Lazy *page = queue->lookup(c->key);
+    switch (c->op) {
+      case QUEUE_ADD:
+        if (!page) {
+          page = add_lazy(c->label, queue->load_, queue->unload_, queue->arg_);
+          page->queue_key_ = c->key;
+          queue->remember(page);
+          break;
+        }
+        // Already added, so it is only relabelled
+        /* FALLTHROUGH */
+      case QUEUE_RELABEL:
+        if (!page)
+          break;
+        page->copy_label(c->label);
+        if (n_relabelled==relabelled_size) {
+          relabelled_size = relabelled_size?relabelled_size<<1:16;
+          relabelled = (Fl_Widget **)realloc(relabelled, relabelled_size*sizeof(Fl_Widget *));
+        }
+        relabelled[n_relabelled++] = page;
+      break;
+      case QUEUE_CLOSE:
+        if (!page)
+          break;
+        queue->forget(page);
+        remove(page);
+        lazy_removed(page);
+        if (n_closed==closed_size) {
+          closed_size = closed_size?closed_size<<1:16;
+          kids = (Fl_Widget **)realloc(kids, closed_size*sizeof(Fl_Widget *));
+        }
+        kids[n_closed++] = page;
+      break;
+    }
+  }
+  if (n_closed)
+    hover(-1, 0);
+  end_update();
+  
+  // Labels changed in place are not looked for, so say which. Finding each
+  // tab is a pass over the children, so many are measured in one pass instead.
+  if (n_relabelled>QUEUE_RELABEL_SEARCHES)
+    tabs_changed();
+  else {
+    for (int k = 0; k<n_relabelled; k++) {
+      const int i = find(relabelled[k]);
+      if (i<children())
+        tab_changed(i);
+    }
+  }
+  free(relabelled);
+  
+  if (n_closed)
+    closed(kids, n_closed);
+  free(kids);
+}
+
+// The trace written by record_events(), see Fl_Scroll_Tabs_Format.H
+struct Fl_Scroll_Tabs_Recorder {
+  FILE *file;
+  double start;
+  int w, h;  // the size last written
+};
+
+static void trace_write(Fl_Scroll_Tabs_Recorder *r, unsigned long t, int e, int text, int x, int y, int dx, int dy, int key, int state) {
+  unsigned char b[TRACE_RECORD_SIZE];
+  put_le32(b, t);
+  b[4] = e;
+  b[5] = text;
+  put_le16(b+6, x&0xFFFF);
+  put_le16(b+8, y&0xFFFF);
+  b[10] = (dx<-128)?0x80:(dx>127)?0x7F:(dx&0xFF);
+  b[11] = (dy<-128)?0x80:(dy>127)?0x7F:(dy&0xFF);
+  put_le16(b+12, key&0xFFFF);
+  put_le16(b+14, (state>>16)&0xFFFF);
+  fwrite(b, 1, TRACE_RECORD_SIZE, r->file);
+}
+
+void Fl_Scroll_Tabs::record_event(int e) {
+  Fl_Scroll_Tabs_Recorder *const r = recorder_;
+  const unsigned long t = (unsigned long)((scroll_clock()-r->start)*1e6);
+  
+  if ((w()!=r->w) || (h()!=r->h)) {
+    trace_write(r, t, TRACE_RESIZE, 0, w(), h(), 0, 0, 0, 0);
+    r->w = w();
+    r->h = h();
+  }
+  
+  const char *const text = Fl::event_text();
+  trace_write(r, t, e, (text && Fl::event_length())?(unsigned char)text[0]:0,
+              Fl::event_x()-x(), Fl::event_y()-y(), Fl::event_dx(), Fl::event_dy(),
+              Fl::event_key(), Fl::event_state());
+}
+
+/**
+  Starts writing the events this widget handles, with when they came and
+  where the mouse was, to \p filename in a compact binary trace, or stops if
+  \p filename is NULL. Labels are not written. The replay program plays a
+  trace back against tabs made up for it and reports how long handling each
+  event and drawing took. Returns 0, or -1 if the file can't be written.
+*/
+int Fl_Scroll_Tabs::record_events(const char *filename) {
+  if (recorder_) {
+    fclose(recorder_->file);
+    free(recorder_);
+    recorder_ = NULL;
+  }
+  if (!filename)
+    return 0;
+  
+  FILE *const file = fopen(filename, "wb");
+  if (!file)
+    return -1;
+  
+  tab_positions();
+  const int first_visible = tab_at(offset);
+  const int value = tabs()?value_index():-1;
+  unsigned char b[TRACE_HEADER_SIZE];
+  memcpy(b, "FLST", 4);
+  b[4] = TRACE_VERSION;
+  b[5] = closebutton_;
+  put_le16(b+6, (tabs_on_bottom_?-tab_height_:tab_height_)&0xFFFF);
+  put_le32(b+8, tabs());
+  put_le32(b+12, (unsigned long)value);
+  put_le32(b+16, (unsigned long)first_visible);
+  fwrite(b, 1, TRACE_HEADER_SIZE, file);
+  
+  recorder_ = (Fl_Scroll_Tabs_Recorder *)calloc(1, sizeof(Fl_Scroll_Tabs_Recorder));
+  recorder_->file = file;
+  recorder_->start = scroll_clock();
+  recorder_->w = recorder_->h = -1;
+  return 0;
+}
+
+/*
+  The snapshot written by save_snapshot(), all little endian so that it
+  can be read in place: a SNAPSHOT_HEADER_SIZE header of "FLSS", then in 32
+  bits each the version, the number of tabs, the selected tab, the scroll
+  offset in two halves, closebutton(), the button width, the minimum and
+  maximum tab widths, fixed_tab_width(), a check width, labelfont() and
+  labelsize(). Then a SNAPSHOT_RECORD_SIZE record per tab: where its label
+  is, its length, the length it is cut to before an ellipsis or -1, its
+  width, and its label font and size. Then the labels, each ending in a
+  null. The check width is of a reference string in labelfont() and
+  labelsize(), so that widths measured with other font files are not used.
+*/
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 56
+#define SNAPSHOT_RECORD_SIZE 24
+#define SNAPSHOT_CHECK_TEXT "Fl_Scroll_Tabs 0123456789 ..."
+
+// The width of the check text, in 64ths of a pixel
+int Fl_Scroll_Tabs::snapshot_check() const {
+  fl_font(labelfont(), labelsize());
+  return (int)(fl_width(SNAPSHOT_CHECK_TEXT)*64.0);
+}
+
+/**
+  Writes the tabs to \p filename in a compact binary snapshot: their labels,
+  fonts and laid out widths, the selected tab, the scroll position and the
+  close button and tab width settings. restore_snapshot() brings them back
+  without measuring any labels. Content is not written. Tabs from a model()
+  can't be saved. Returns 0, or -1 if the file can't be written.
+*/
+int Fl_Scroll_Tabs::save_snapshot(const char *filename) {
+  if (model_)
+    return -1;
+  
+  // Guessed widths aren't worth keeping
+  tab_positions();
+  for (int i = 0; i<tab_count; i++) {
+    if (tab_estimated[i])
+      measure_tab(i, 1, 0);
+  }
+  calculate_tab_sizes();
+  
+  const int n = tab_count;
+  unsigned long labels = 0;
+  for (int i = 0; i<n; i++) {
+    const char *const l = child(i)->label();
+    labels += (l?strlen(l):0)+1;
+  }
+  
+  const unsigned long size = SNAPSHOT_HEADER_SIZE+(unsigned long)n*SNAPSHOT_RECORD_SIZE+labels;
+  unsigned char *const b = (unsigned char *)malloc(size);
+  memcpy(b, "FLSS", 4);
+  put_le32(b+4, SNAPSHOT_VERSION);
+  put_le32(b+8, n);
+  put_le32(b+12, (unsigned long)(n?value_index():-1));
+  put_le32(b+16, offset&0xFFFFFFFFul);
+  put_le32(b+20, (offset>>16)>>16);
+  put_le32(b+24, closebutton_);
+  put_le32(b+28, button_width_);
+  put_le32(b+32, (unsigned long)minimum_tab_width_);
+  put_le32(b+36, (unsigned long)maximum_tab_width_);
+  put_le32(b+40, fixed_w_);
+  put_le32(b+44, (unsigned long)snapshot_check());
+  put_le32(b+48, (unsigned long)labelfont());
+  put_le32(b+52, (unsigned long)labelsize());
+  
+  unsigned long at = SNAPSHOT_HEADER_SIZE+(unsigned long)n*SNAPSHOT_RECORD_SIZE;
+  for (int i = 0; i<n; i++) {
+    const char *const l = child(i)->label()?child(i)->label():"";
+    const int len = strlen(l);
+    
+    // A label cut short is drawn as the start of it and an ellipsis
+    const char *const drawn = tab_label(i);
+    const int cut = (fixed_w_ || !strcmp(drawn, l))?-1:(int)strlen(drawn)-3;
+    
+    unsigned char *const r = b+SNAPSHOT_HEADER_SIZE+(unsigned long)i*SNAPSHOT_RECORD_SIZE;
+    put_le32(r, at);
+    put_le32(r+4, len);
+    put_le32(r+8, (unsigned long)cut);
+    put_le32(r+12, (unsigned long)tab_width[i]);
+    put_le32(r+16, (unsigned long)tab_fonts[i]);
+    put_le32(r+20, (unsigned long)tab_sizes[i]);
+    memcpy(b+at, l, len+1);
+    at += len+1;
+  }
+  
+  FILE *const file = fopen(filename, "wb");
+  int written = file && (fwrite(b, 1, size, file)==size);
+  if (file && fclose(file))
+    written = 0;
+  free(b);
+  return written?0:-1;
+}
+
+/**
+  Replaces the tabs with those saved in \p filename by save_snapshot(). The tabs
+  are made with add_lazy(), \p load, \p unload and \p arg, so only the selected
+  tab's content is built. If the labels would still be laid out the same, which
+  is when the tab bar's button width and labelfont() measure as they did, the
+  saved widths are used and no label is measured. Otherwise the tabs are laid
+  out as usual. The selected tab, the scroll position and the close button and
+  tab width settings are restored too. The tabs there were are removed and
+  passed to the close callbacks, as if closed, or deleted if there are none.
+  Returns 0, or -1 if the file can't be read or isn't a snapshot, in which
+  case the tabs are not changed.
+*/
+int Fl_Scroll_Tabs::restore_snapshot(const char *filename, Fl_Scroll_Tabs_Load_Cb load, Fl_Scroll_Tabs_Unload_Cb unload, void *arg) {
+  if (model_)
+    return -1;
+  
+  FILE *const file = fopen(filename, "rb");
+  if (!file)
+    return -1;
+  fseek(file, 0, SEEK_END);
+  const long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  unsigned char *const b = (size>=SNAPSHOT_HEADER_SIZE)?(unsigned char *)malloc(size):NULL;
+  const int read = b && (fread(b, 1, size, file)==(size_t)size);
+  fclose(file);
+  
+  // Check everything before changing anything
+  unsigned long n = 0;
+  int valid = read && !memcmp(b, "FLSS", 4) && (get_le32(b+4)==SNAPSHOT_VERSION);
+  if (valid) {
+    n = get_le32(b+8);
+    valid = (n<=(unsigned long)(size-SNAPSHOT_HEADER_SIZE)/SNAPSHOT_RECORD_SIZE);
+  }
+  for (unsigned long i = 0; valid && (i<n); i++) {
+    const unsigned char *const r = b+SNAPSHOT_HEADER_SIZE+i*SNAPSHOT_RECORD_SIZE;
+    const unsigned long at = get_le32(r), len = get_le32(r+4);
+    const long cut = (long)(int)get_le32(r+8);
+    valid = (at<(unsigned long)size) && (len<(unsigned long)size-at) && !b[at+len] && (cut<=(long)len) && (cut>=-1);
+  }
+  if (!valid) {
+    free(b);
+    return -1;
+  }
+  
+  // Let go of the tabs we had, from the last one back so that none move
+  cancel_async_job();
+  drop_tabs(0);
+  // No tab uses the label pool any more
+  label_pool_used_ = label_pool_garbage_ = 0;
+  const int n_closed = children();
+  Fl_Widget **const kids = (Fl_Widget **)malloc((n_closed?n_closed:1)*sizeof(Fl_Widget *));
+  for (int i = n_closed-1; i>=0; i--) {
+    Fl_Widget *const kid = child(i);
+    remove(i);
+    lazy_removed(kid);
+    kids[i] = kid;
+  }
+  value_ = update_value_ = update_visible_ = NULL;
+  hover_tab_ = drag_tab_ = -1;
+  hover_close_ = drag_moved_ = 0;
+  if (find_)
+    find_->valid = 0;
+  
+  closebutton_ = get_le32(b+24)!=0;
+  minimum_tab_width_ = (int)get_le32(b+32);
+  maximum_tab_width_ = (int)get_le32(b+36);
+  fixed_w_ = (int)get_le32(b+40);
+  
+  for (unsigned long i = 0; i<n; i++) {
+    const unsigned char *const r = b+SNAPSHOT_HEADER_SIZE+i*SNAPSHOT_RECORD_SIZE;
+    Fl_Scroll_Tabs_Lazy *const page = add_lazy((const char *)b+get_le32(r), load, unload, arg);
+    page->labelfont((Fl_Font)get_le32(r+16));
+    page->labelsize((Fl_Fontsize)get_le32(r+20));
+  }
+  // Only what the saved layout is checked against, since laying out would measure every label
+  tab_bar_size();
+  
+  const int same = n && (get_le32(b+28)==(unsigned long)button_width_) &&
+                   (get_le32(b+48)==(unsigned long)labelfont()) && (get_le32(b+52)==(unsigned long)labelsize()) &&
+                   (get_le32(b+44)==(unsigned long)snapshot_check());
+  if (same) {
+    // Lay the tabs out as they were saved, as tab_positions() would have
+    reserve_tab_arrays(n);
+    for (unsigned long i = 0; i<n; i++) {
+      const unsigned char *const r = b+SNAPSHOT_HEADER_SIZE+i*SNAPSHOT_RECORD_SIZE;
+      const char *const text = (const char *)b+get_le32(r);
+      const int len = get_le32(r+4), cut = (int)get_le32(r+8);
+      Fl_Widget *const kid = child(i);
+      
+      tab_label_offsets[i] = -1;
+      if (cut<0)
+        memcpy(label_space(i, len+1), text, len+1);
+      else {
+        char *const l = label_space(i, cut+4);
+        memcpy(l, text, cut);
+        strcpy(l+cut, "...");
+      }
+      tab_kids[i] = kid;
+      tab_label_ptrs[i] = kid->label();
+      tab_label_hashes[i] = label_hash(kid->label());
+      tab_fonts[i] = kid->labelfont();
+      tab_sizes[i] = kid->labelsize();
+      tab_width[i] = (int)get_le32(r+12);
+      tab_estimated[i] = 0;
+    }
+    tab_count = n;
+    tree_count_ = 0;
+    if (!fixed_w_)
+      update_tree();
+    layout_valid_ = 1;
+    model_changed_ = 0;
+    layout_button_width_ = button_width_;
+    layout_serial_++;
+  }
+  else
+    invalidate_layout();
+  value_children_ = -1;
+  
+  const unsigned long value = get_le32(b+12);
+  const unsigned long saved_offset = get_le32(b+16)|((get_le32(b+20)<<16)<<16);
+  free(b);
+  
+  if (value<n)
+    push((int)value);
+  else
+    ensure_value();
+  
+  tab_positions();
+  const long m = max_offset();
+  offset = (saved_offset>(unsigned long)m)?m:saved_offset;
+  scroll_target_ = -1.0;
+  redraw();
+  
+  // The tabs we had were closed, and are deleted unless a close callback takes them
+  if (close_batch_callback_ || close_callback_)
+    closed(kids, n_closed);
+  else {
+    for (int k = 0; k<n_closed; k++)
+      delete kids[k];
+  }
+  free(kids);
+  return 0;
+}
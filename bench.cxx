@@ -0,0 +1,202 @@
+// Times Fl_Scroll_Tabs against Fl_Tabs without any user interaction.
+//
+// Drawing is done into an Fl_Image_Surface, so nothing is shown, but an X
+// display is still needed. Run it under Xvfb when there is none:
+//
+//     xvfb-run ./bench [max_tabs] [seconds_per_op]
+//
+// Prints one CSV line per widget, tab count, close button setting and operation,
+// with the rate and the percentiles of the time one operation took.
+
+#include "Fl_Scroll_Tabs.H"
+#include <FL/Fl.H>
+#include <FL/Fl_Group.H>
+#include <FL/Fl_Window.H>
+#include <FL/Fl_Tabs.H>
+#include <FL/Fl_Image_Surface.H>
+#include <FL/x.H>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define W 800
+#define H 300
+#define TAB_ROW 10  // a y inside the tab bar
+#define MAXIMUM_SAMPLES 20000
+
+// Exposes what the benchmark needs that isn't public
+class Bench_Scroll_Tabs : public Fl_Scroll_Tabs {
+public:
+  Bench_Scroll_Tabs(int X, int Y, int W_, int H_) : Fl_Scroll_Tabs(X, Y, W_, H_) {}
+  int layout() {return tab_positions();}
+  // Turns the wheel the other way at either end
+  void bounce() {
+    if ((Fl::e_dy>0) && !can_scroll_right()) Fl::e_dy = -1;
+    else if ((Fl::e_dy<0) && !can_scroll_left()) Fl::e_dy = 1;
+  }
+  // Lays every tab out again on the next layout()
+  void invalidate() {closebutton(closebutton());}
+};
+
+static double now() {
+#ifdef WIN32
+  LARGE_INTEGER t, f;
+  QueryPerformanceCounter(&t);
+  QueryPerformanceFrequency(&f);
+  return (double)t.QuadPart/(double)f.QuadPart;
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec+t.tv_nsec*1e-9;
+#endif
+}
+
+// Same sequence on every run, so that both widgets get the same labels
+static unsigned random_state = 1;
+static unsigned next_random() {
+  random_state ^= random_state<<13;
+  random_state ^= random_state>>17;
+  random_state ^= random_state<<5;
+  return random_state;
+}
+
+static const char *const words[] = {
+  "main", "Fl_Scroll_Tabs", "README", "a", "test", "configuration", "x",
+  "CMakeLists", "document", "untitled", "index", "very_long_file_name_here"
+};
+
+static void make_label(char *l, int i) {
+  int len = 0;
+  const int n = 1+next_random()%3;
+  for (int k = 0; k<n; k++)
+    len += sprintf(l+len, (k==0)?"%s":" %s", words[next_random()%(sizeof(words)/sizeof(*words))]);
+  sprintf(l+len, " %d", i);
+}
+
+static void add_tabs(Fl_Group *tabs, int n) {
+  char label[128];
+  random_state = 1;
+  tabs->begin();
+  for (int i = 0; i<n; i++) {
+    make_label(label, i);
+    Fl_Group *g = new Fl_Group(tabs->x(), tabs->y()+25, tabs->w(), tabs->h()-25);
+    g->copy_label(label);
+    g->end();
+  }
+  tabs->end();
+}
+
+// Times of single operations, in seconds
+static double samples[MAXIMUM_SAMPLES];
+static int sample_count;
+
+static int compare_doubles(const void *a, const void *b) {
+  const double x = *(const double *)a, y = *(const double *)b;
+  return (x<y)?-1:(x>y);
+}
+
+static void report(const char *widget, int tabs, int close, const char *op, double total, long ops) {
+  qsort(samples, sample_count, sizeof(double), compare_doubles);
+  const double p50 = samples[sample_count*50/100], p90 = samples[sample_count*90/100],
+               p99 = samples[sample_count*99/100], max = samples[sample_count-1];
+  printf("%s,%d,%d,%s,%ld,%.1f,%.0f,%.0f,%.0f,%.0f\n", widget, tabs, close, op, ops,
+         ops/total, p50*1e9, p90*1e9, p99*1e9, max*1e9);
+  fflush(stdout);
+}
+
+static double budget = 0.5;  // seconds spent on each operation
+
+/*
+  Runs `op' `batch' times per sample until the budget is spent, at least
+  three samples, and reports the time of one operation.
+*/
+#define TIME_OP(WIDGET, TABS, CLOSE, NAME, BATCH, SETUP, OP) do { \
+    sample_count = 0; \
+    long ops = 0; \
+    double total = 0.0; \
+    while ((sample_count<3) || ((total<budget) && (sample_count<MAXIMUM_SAMPLES))) { \
+      SETUP; \
+      const double start = now(); \
+      for (int b = 0; b<(BATCH); b++) {OP;} \
+      const double t = now()-start; \
+      samples[sample_count++] = t/(BATCH); \
+      total += t; \
+      ops += (BATCH); \
+    } \
+    report(WIDGET, TABS, CLOSE, NAME, total, ops); \
+  } while (0)
+
+static void bench_scroll_tabs(Fl_Image_Surface &surface, int n, int close) {
+  Fl_Window window(W, H);
+  Bench_Scroll_Tabs *tabs = new Bench_Scroll_Tabs(0, 0, W, H);
+  tabs->end();
+  window.end();
+  add_tabs(tabs, n);
+  tabs->closebutton(close);
+  tabs->smooth_scroll(0);
+  tabs->layout();
+
+  TIME_OP("Fl_Scroll_Tabs", n, close, "layout", 1, tabs->invalidate(), tabs->layout());
+  TIME_OP("Fl_Scroll_Tabs", n, close, "layout_unchanged", 1, (void)0, tabs->layout());
+
+  int x = 0;
+  TIME_OP("Fl_Scroll_Tabs", n, close, "which", 64, x = next_random()%W, tabs->which(x+b%8, TAB_ROW));
+
+  int tab = 0;
+  TIME_OP("Fl_Scroll_Tabs", n, close, "make_tab_visible", 64, tab = next_random()%n, tabs->make_tab_visible((tab+b)%n));
+
+  // One wheel notch at a time
+  tabs->make_tab_visible(0);
+  Fl::e_x = W/2;
+  Fl::e_y = TAB_ROW;
+  Fl::e_dx = 0;
+  Fl::e_dy = 1;
+  TIME_OP("Fl_Scroll_Tabs", n, close, "scroll", 64, (void)0, tabs->bounce(); tabs->handle(FL_MOUSEWHEEL));
+
+  surface.set_current();
+  TIME_OP("Fl_Scroll_Tabs", n, close, "draw", 1, tabs->make_tab_visible(next_random()%n), surface.draw(tabs));
+  Fl_Display_Device::display_device()->set_current();
+}
+
+// Fl_Tabs lays its tabs out on every call and has no close buttons or scrolling
+static void bench_tabs(Fl_Image_Surface &surface, int n) {
+  Fl_Window window(W, H);
+  Fl_Tabs *tabs = new Fl_Tabs(0, 0, W, H);
+  tabs->end();
+  window.end();
+  add_tabs(tabs, n);
+  tabs->value(tabs->child(0));
+
+  int x = 0;
+  TIME_OP("Fl_Tabs", n, 0, "which", (n<=1000)?64:1, x = next_random()%W, tabs->which(x+b%8, TAB_ROW));
+
+  surface.set_current();
+  TIME_OP("Fl_Tabs", n, 0, "draw", 1, (void)0, surface.draw(tabs));
+  Fl_Display_Device::display_device()->set_current();
+}
+
+int main(int argc, char *argv[]) {
+  int max_tabs = 100000;
+  if (argc>1)
+    max_tabs = atoi(argv[1]);
+  if (argc>2)
+    budget = atof(argv[2]);
+
+  fl_open_display();
+  Fl_Image_Surface surface(W, H);
+
+  printf("widget,tabs,closebutton,op,ops,ops_per_sec,p50_ns,p90_ns,p99_ns,max_ns\n");
+  for (int n = 10; n<=max_tabs; n *= 10) {
+    bench_tabs(surface, n);
+    bench_scroll_tabs(surface, n, 0);
+    bench_scroll_tabs(surface, n, 1);
+  }
+
+  return 0;
+}
@@ -0,0 +1,251 @@
+// Plays back a trace written by Fl_Scroll_Tabs::record_events() and reports
+// how long the widget took to handle each kind of event and to draw.
+//
+// The tabs are made up, with as many as the trace was recorded with unless
+// a number is given. Drawing is done into an Fl_Image_Surface, so nothing is
+// shown, but an X display is still needed. Run it under Xvfb when there is none:
+//
+//     xvfb-run ./replay trace [tabs] [-p]
+//
+// Events are played back as fast as they can be, with smooth scrolling off.
+// With -p they are played back at the pace they were recorded, with smooth
+// scrolling on, so that timeouts such as held scroll buttons run as they did.
+
+#include "Fl_Scroll_Tabs.H"
+#include "Fl_Scroll_Tabs_Format.H"
+#include <FL/Fl.H>
+#include <FL/Fl_Group.H>
+#include <FL/Fl_Window.H>
+#include <FL/Fl_Image_Surface.H>
+#include <FL/x.H>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define BUCKETS 24  // under 1us, under 2us, ..., and the rest
+#define EVENT_KINDS 256  // one per event, DRAW_KIND for drawing
+#define DRAW_KIND TRACE_RESIZE
+
+static double now() {
+#ifdef WIN32
+  LARGE_INTEGER t, f;
+  QueryPerformanceCounter(&t);
+  QueryPerformanceFrequency(&f);
+  return (double)t.QuadPart/(double)f.QuadPart;
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec+t.tv_nsec*1e-9;
+#endif
+}
+
+static const char *const words[] = {
+  "main", "Fl_Scroll_Tabs", "README", "a", "test", "configuration", "x",
+  "CMakeLists", "document", "untitled", "index", "very_long_file_name_here"
+};
+
+// Tabs are as high as the space above their children, or below them if `th' is negative
+static void add_tabs(Fl_Scroll_Tabs *tabs, int n, int th) {
+  const int Y = (th<0)?tabs->y():tabs->y()+th, H = tabs->h()-((th<0)?-th:th);
+  char label[128];
+  tabs->begin_update();
+  tabs->begin();
+  for (int i = 0; i<n; i++) {
+    sprintf(label, "%s %d", words[(i*7)%(sizeof(words)/sizeof(*words))], i);
+    Fl_Group *g = new Fl_Group(tabs->x(), Y, tabs->w(), H);
+    g->copy_label(label);
+    g->end();
+  }
+  tabs->end();
+  tabs->end_update();
+}
+
+// Times, in seconds, of each kind of event
+struct Samples {
+  double *times;
+  int count, size;
+};
+
+static Samples samples[EVENT_KINDS];
+
+static void add_sample(int kind, double t) {
+  Samples &s = samples[kind];
+  if (s.count==s.size) {
+    s.size = s.size?s.size<<1:64;
+    s.times = (double *)realloc(s.times, s.size*sizeof(double));
+  }
+  s.times[s.count++] = t;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  const double x = *(const double *)a, y = *(const double *)b;
+  return (x<y)?-1:(x>y);
+}
+
+static void report(const char *name, Samples &s) {
+  if (!s.count)
+    return;
+  qsort(s.times, s.count, sizeof(double), compare_doubles);
+  printf("%s: %d, p50 %.1fus, p90 %.1fus, p99 %.1fus, max %.1fus\n", name, s.count,
+         s.times[s.count*50/100]*1e6, s.times[s.count*90/100]*1e6,
+         s.times[s.count*99/100]*1e6, s.times[s.count-1]*1e6);
+
+  int buckets[BUCKETS] = {0};
+  for (int k = 0; k<s.count; k++) {
+    int b = 0;
+    for (double limit = 1e-6; (b<BUCKETS-1) && (s.times[k]>=limit); limit *= 2.0)
+      b++;
+    buckets[b]++;
+  }
+
+  int most = 0;
+  for (int b = 0; b<BUCKETS; b++) {
+    if (buckets[b]>most)
+      most = buckets[b];
+  }
+  for (int b = 0; b<BUCKETS; b++) {
+    if (!buckets[b])
+      continue;
+    if (b==BUCKETS-1)
+      printf("  >=%8luus %8d ", 1ul<<(b-1), buckets[b]);
+    else
+      printf("  <%9luus %8d ", 1ul<<b, buckets[b]);
+    for (int bar = (buckets[b]*50+most-1)/most; bar>0; bar--)
+      putchar('#');
+    putchar('\n');
+  }
+}
+
+static const char *event_name(int e) {
+  switch (e) {
+    case FL_PUSH: return "push";
+    case FL_RELEASE: return "release";
+    case FL_ENTER: return "enter";
+    case FL_LEAVE: return "leave";
+    case FL_DRAG: return "drag";
+    case FL_FOCUS: return "focus";
+    case FL_UNFOCUS: return "unfocus";
+    case FL_KEYBOARD: return "keyboard";
+    case FL_KEYUP: return "keyup";
+    case FL_MOVE: return "move";
+    case FL_SHORTCUT: return "shortcut";
+    case FL_MOUSEWHEEL: return "mousewheel";
+    case DRAW_KIND: return "draw";
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  const char *filename = NULL;
+  int n = -1, paced = 0;
+  for (int a = 1; a<argc; a++) {
+    if (!strcmp(argv[a], "-p"))
+      paced = 1;
+    else if (!filename)
+      filename = argv[a];
+    else
+      n = atoi(argv[a]);
+  }
+  if (!filename) {
+    fprintf(stderr, "usage: %s trace [tabs] [-p]\n", argv[0]);
+    return 1;
+  }
+
+  FILE *const file = fopen(filename, "rb");
+  unsigned char header[TRACE_HEADER_SIZE];
+  if (!file || (fread(header, 1, TRACE_HEADER_SIZE, file)!=TRACE_HEADER_SIZE) ||
+      memcmp(header, "FLST", 4) || (header[4]!=TRACE_VERSION)) {
+    fprintf(stderr, "%s: not a trace\n", filename);
+    return 1;
+  }
+  if (n<0)
+    n = (int)get_le32(header+8);
+  const int value = (int)get_le32(header+12), first_visible = (int)get_le32(header+16);
+
+  fl_open_display();
+  int W = 800, H = 300;
+  Fl_Window window(W, H);
+  Fl_Scroll_Tabs *tabs = new Fl_Scroll_Tabs(0, 0, W, H);
+  tabs->end();
+  window.end();
+  tabs->closebutton(header[5]);
+  tabs->smooth_scroll(paced);
+  add_tabs(tabs, n, (short)get_le16(header+6));
+  if ((value>=0) && (value<n))
+    tabs->push(value);
+  if ((first_visible>=0) && (first_visible<n))
+    tabs->make_tab_visible(first_visible);
+
+  Fl_Image_Surface *surface = new Fl_Image_Surface(W, H);
+  char text[2] = {0, 0};
+  unsigned char r[TRACE_RECORD_SIZE];
+  const double start = now();
+  long events = 0;
+  while (fread(r, 1, TRACE_RECORD_SIZE, file)==TRACE_RECORD_SIZE) {
+    const double t = get_le32(r)*1e-6;
+    const int e = r[4];
+    const int x = (short)get_le16(r+6), y = (short)get_le16(r+8);
+
+    // Let timeouts run until the event is due
+    if (paced) {
+      double wait;
+      while ((wait = t-(now()-start))>0.0)
+        Fl::wait(wait);
+    }
+
+    if (e==TRACE_RESIZE) {
+      W = x;
+      H = y;
+      window.size(W, H);
+      tabs->resize(0, 0, W, H);
+      delete surface;
+      surface = new Fl_Image_Surface(W, H);
+      continue;
+    }
+
+    Fl::e_x = Fl::e_x_root = x;
+    Fl::e_y = Fl::e_y_root = y;
+    Fl::e_dx = (signed char)r[10];
+    Fl::e_dy = (signed char)r[11];
+    Fl::e_keysym = get_le16(r+12);
+    Fl::e_state = get_le16(r+14)<<16;
+    text[0] = r[5];
+    Fl::e_text = text;
+    Fl::e_length = text[0]?1:0;
+
+    double before = now();
+    tabs->handle(e);
+    add_sample(e, now()-before);
+    events++;
+
+    if (tabs->damage()) {
+      surface->set_current();
+      before = now();
+      surface->draw(tabs);
+      add_sample(DRAW_KIND, now()-before);
+      Fl_Display_Device::display_device()->set_current();
+      tabs->clear_damage();
+    }
+  }
+  fclose(file);
+
+  printf("%s: %ld events, %d tabs, %dx%d\n", filename, events, n, W, H);
+  for (int k = 0; k<EVENT_KINDS; k++) {
+    char other[32];
+    const char *name = event_name(k);
+    if (!name) {
+      sprintf(other, "event %d", k);
+      name = other;
+    }
+    report(name, samples[k]);
+  }
+
+  delete surface;
+  return 0;
+}